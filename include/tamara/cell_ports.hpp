@@ -0,0 +1,62 @@
+// TaMaRa: An automated triple modular redundancy EDA flow for Yosys.
+//
+// Copyright (c) 2025 Matt Young.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
+// was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#pragma once
+#include "ankerl/unordered_dense.hpp"
+#include "kernel/celltypes.h"
+#include "kernel/rtlil.h"
+#include "kernel/yosys_common.h"
+#include <cstdint>
+#include <vector>
+
+USING_YOSYS_NAMESPACE;
+
+namespace tamara {
+
+//! Table of the port directions of every cell type known to a design.
+//!
+//! This is built once per pass from Yosys' CellTypes, which is expensive to construct, and then shared by
+//! everything that needs to know whether a port is an input or an output. Each cell type stores its port
+//! names sorted by IdString index, alongside a bitmask of which of those ports are inputs and which are
+//! outputs. The oracle is never modified after it's built, so it's safe to share between threads.
+class CellPortOracle {
+public:
+    //! Builds the table for the internal cell library, plus the modules in the design
+    explicit CellPortOracle(RTLIL::Design *design);
+
+    //! Returns true if the port is an output of the given cell type
+    [[nodiscard]] bool isOutput(const RTLIL::IdString &type, const RTLIL::IdString &port) const {
+        return test(type, port, true);
+    }
+
+    //! Returns true if the port is an input of the given cell type
+    [[nodiscard]] bool isInput(const RTLIL::IdString &type, const RTLIL::IdString &port) const {
+        return test(type, port, false);
+    }
+
+    //! Returns true if the cell type is known
+    [[nodiscard]] bool isKnown(const RTLIL::IdString &type) const {
+        return types.contains(type.index_);
+    }
+
+private:
+    //! Kept alive so that the IdStrings the tables are keyed by stay allocated
+    CellTypes cellTypes;
+
+    //! Port directions for one cell type. Bit i of each mask corresponds to ports[i].
+    struct PortTable {
+        std::vector<int> ports;
+        std::vector<uint64_t> inputs;
+        std::vector<uint64_t> outputs;
+    };
+
+    //! Keyed by IdString index
+    ankerl::unordered_dense::map<int, PortTable> types;
+
+    [[nodiscard]] bool test(const RTLIL::IdString &type, const RTLIL::IdString &port, bool output) const;
+};
+
+} // namespace tamara
@@ -0,0 +1,135 @@
+// TaMaRa: An automated triple modular redundancy EDA flow for Yosys.
+//
+// Copyright (c) 2025 Matt Young.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
+// was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#pragma once
+#include "ankerl/unordered_dense.hpp"
+#include "kernel/rtlil.h"
+#include "kernel/yosys_common.h"
+#include "tamara/object_tags.hpp"
+#include "tamara/util.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+USING_YOSYS_NAMESPACE;
+
+namespace tamara {
+
+//! How often TaMaRa validates the netlist as it edits it. Each level includes the checks of the ones before.
+enum class VerifyLevel : uint8_t {
+    //! Never validate the netlist
+    None,
+    //! Check the whole module once, at the end of the pass
+    End,
+    //! Also check every touched cell on commit, and the whole module after each cone is wired
+    Cone,
+    //! Also check the whole module after every edit, i.e. every replica and voter wire, cell, port and
+    //! connection, so a broken netlist is caught at the edit that broke it
+    Paranoid,
+};
+
+//! Parses the argument of `tamara_tmr -verify`, returning nothing if it isn't a valid level
+std::optional<VerifyLevel> parseVerifyLevel(const std::string &level);
+
+//! Journal of the edits TaMaRa makes to a module, which are applied and validated in batches.
+//!
+//! Wires and cells are created in the module straight away, as later edits need to refer to them, and ports
+//! are set straight away too. Global connections are only added to the module on @ref commit. Commit is
+//! also where the connection index catches up, so the cost of a batch depends on the number of edits rather
+//! than the size of the module. To that end, the journal remembers what each port it rewires was connected
+//! to before the batch. How much is validated, and when, depends on the @ref VerifyLevel.
+class EditJournal {
+public:
+    //! Creates a journal for the module. If a connection index is given, it is updated on every commit.
+    explicit EditJournal(
+        RTLIL::Module *module, ConnectionIndex *index = nullptr, VerifyLevel level = VerifyLevel::End)
+        : module(module)
+        , index(index)
+        , level(level) {
+    }
+
+    //! Adds a new wire to the module with the given width
+    RTLIL::Wire *addWire(const RTLIL::IdString &name, int width = 1);
+
+    //! Adds a new wire to the module, copying the other wire's width, flags and attributes
+    RTLIL::Wire *addWire(const RTLIL::IdString &name, const RTLIL::Wire *other);
+
+    //! Adds a new cell to the module, copying the other cell's type, parameters, ports and attributes
+    RTLIL::Cell *addCell(const RTLIL::IdString &name, const RTLIL::Cell *other);
+
+    //! Records a cell that was created through one of the RTLIL::Module helpers, e.g. addLogicAnd
+    RTLIL::Cell *recordCell(RTLIL::Cell *cell);
+
+    //! Connects the port of the cell to the signal
+    void setPort(RTLIL::Cell *cell, const RTLIL::IdString &port, const RTLIL::SigSpec &signal);
+
+    //! Queues a global connection lhs = rhs, which is added to the module on the next @ref commit. At
+    //! VerifyLevel::Paranoid it's added straight away instead, so that it can be checked.
+    void connect(const RTLIL::SigSpec &lhs, const RTLIL::SigSpec &rhs);
+
+    //! Applies the queued connections, checks the objects touched since the last commit if the verify level
+    //! asks for it, and brings the connection index up to date. Does nothing if the journal is empty.
+    void commit();
+
+    //! Checks the whole module, if the verify level is at least the given one. The journal should have been
+    //! committed first.
+    void verify(VerifyLevel at) const;
+
+    //! Returns the number of edits waiting to be committed
+    [[nodiscard]] size_t pending() const {
+        return cells.size() + wires.size() + connections.size();
+    }
+
+    //! Returns the module being edited
+    [[nodiscard]] RTLIL::Module *getModule() const {
+        return module;
+    }
+
+    //! Returns the connection index kept up to date by this journal. It's an error to call this if the
+    //! journal doesn't have one.
+    [[nodiscard]] ConnectionIndex &getIndex() const;
+
+    //! Returns the tags of the objects replicated and created through this journal. They aren't written to
+    //! attributes by @ref commit, see ObjectTags::writeAttributes.
+    [[nodiscard]] ObjectTags &getTags() {
+        return tags;
+    }
+
+private:
+    RTLIL::Module *module;
+    ConnectionIndex *index;
+    VerifyLevel level;
+    ObjectTags tags;
+
+    //! Cells added or re-wired since the last commit, in the order they were first touched
+    std::vector<RTLIL::Cell *> cells;
+    ankerl::unordered_dense::set<RTLIL::Cell *> touched;
+    //! Cells added since the last commit, which are indexed as a whole
+    ankerl::unordered_dense::set<RTLIL::Cell *> added;
+    //! Ports of existing cells re-wired since the last commit, with what they were connected to before
+    ankerl::unordered_dense::map<RTLIL::Cell *, std::vector<std::pair<RTLIL::IdString, RTLIL::SigSpec>>>
+        rewired;
+    //! Wires added since the last commit
+    std::vector<RTLIL::Wire *> wires;
+    //! Connections queued since the last commit
+    std::vector<std::pair<RTLIL::SigSpec, RTLIL::SigSpec>> connections;
+    //! Number of queued connections that have already been added to the module, at VerifyLevel::Paranoid
+    size_t applied = 0;
+
+    //! Marks the cell as needing to be checked and re-indexed
+    void touch(RTLIL::Cell *cell);
+
+    //! Marks a new cell as needing to be checked and indexed
+    void add(RTLIL::Cell *cell);
+
+    //! Checks the whole module after a single edit, at VerifyLevel::Paranoid
+    void checkEdit() const;
+};
+
+} // namespace tamara
@@ -7,6 +7,7 @@
 #pragma once
 #include "kernel/rtlil.h"
 #include "kernel/yosys_common.h"
+#include "tamara/edit_journal.hpp"
 #include "tamara/util.hpp"
 #include <memory>
 #include <string>
@@ -30,12 +31,12 @@ public:
     /// Processes the given module.
     virtual void processModule(RTLIL::Module *module) { };
 
-    /// Processes the given cell in a module.
-    virtual void processCell(RTLIL::Cell *cell) { };
-
-    /// Processes the given wire in a module.
+    /// Processes one normalised bit whose drivers or loads changed since the walkers last ran, with the
+    /// number of each it has in the connection index. Walkers that edit the netlist must do so through the
+    /// journal, which is committed once the walker has processed every changed bit.
     // NOLINTNEXTLINE(bugprone-easily-swappable-parameters)
-    virtual void processWire(RTLIL::Wire *wire, size_t driverCount, size_t drivenCount, const RTLILWireConnections &connections) { };
+    virtual void processBit(
+        const RTLIL::SigBit &bit, size_t driverCount, size_t loadCount, EditJournal &journal) { };
 
     /// Returns the name of this @ref FixWalker. Implementers should override this.
     virtual std::string name() {
@@ -51,29 +52,34 @@ public:
     /// Adds a @ref FixWalker to be executed
     void add(const std::shared_ptr<FixWalker> &walker);
 
-    /// Executes all added @ref FixWalkers on a design.
-    void execute(RTLIL::Module *module);
+    /// Executes all added @ref FixWalkers on a design, using the journal's live connection index rather than
+    /// re-analysing the module. Only the bits whose drivers or loads changed since the walkers last ran, and
+    /// the bits changed by an earlier walker, are visited, so this is proportional to the edits rather than
+    /// the size of the module. The journal is committed before and after each walker.
+    void execute(RTLIL::Module *module, EditJournal &journal);
 
 private:
     std::vector<std::shared_ptr<FixWalker>> walkers;
 };
 
-/// A @ref FixWalker that looks for wires with multiple drivers; where the inputs are replicated nodes, and
-/// the outputs are voters.
+/// A @ref FixWalker that looks for bits with multiple drivers; where the drivers are replicated cells, and so
+/// are the loads.
 class MultiDriverFixer : public FixWalker {
 public:
     MultiDriverFixer() = default;
 
-    void processWire(RTLIL::Wire *wire, size_t driverCount, size_t drivenCount, const RTLILWireConnections &connections) override;
+    void processBit(
+        const RTLIL::SigBit &bit, size_t driverCount, size_t loadCount, EditJournal &journal) override;
 
     std::string name() override {
         return "MultiDriverFixer";
     }
 
 private:
-    void rewire(RTLIL::Wire *wire, const RTLILWireConnections &connections);
+    void rewire(const RTLIL::SigBit &bit, const ConnectionIndex::BitConnections &connections,
+        EditJournal &journal);
 
-    void reconnect(RTLIL::Wire *target, RTLIL::Cell *input, RTLIL::Cell *output);
+    void reconnect(const PortBit &driver, const PortBit &load, EditJournal &journal);
 };
 
 }; // namespace tamara
@@ -8,15 +8,17 @@
 #include "kernel/log.h"
 #include "kernel/rtlil.h"
 #include "kernel/yosys_common.h"
+#include "tamara/edit_journal.hpp"
 #include "tamara/fix_walker.hpp"
 #include "tamara/util.hpp"
 #include "tamara/voter_builder.hpp"
+#include <array>
 #include <cstddef>
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <memory_resource>
 #include <optional>
-#include <queue>
 
 USING_YOSYS_NAMESPACE;
 
@@ -24,6 +26,13 @@ namespace tamara {
 
 using SigSpecPtr = std::shared_ptr<RTLIL::SigSpec>;
 
+//! Kind of a @ref TMRGraphNode, so that nodes can be classified with a branch rather than RTTI
+enum class NodeKind : uint8_t {
+    ElementCell,
+    FF,
+    IO,
+};
+
 //! Base node class in the graph
 class TMRGraphNode : public std::enable_shared_from_this<TMRGraphNode> {
 public:
@@ -42,20 +51,47 @@ public:
     //! Equality operator for @ref TMRGraphNode::Ptr
     // virtual bool operator==(const TMRGraphNode::Ptr &nodePtr) const = 0;
 
-    //! Constructs a new default TMRGraphNode with the given ID. ID must be monotonically increasing.
-    //! Each cone has a unique ID.
-    explicit TMRGraphNode(uint32_t id)
-        : id(id) {
+    //! Constructs a new default TMRGraphNode of the given kind for the given node in the @ref NetlistGraph,
+    //! with the given cone ID. ID must be monotonically increasing. Each cone has a unique ID.
+    TMRGraphNode(NodeKind kind, NodeIndex index, uint32_t id)
+        : kind(kind)
+        , index(index)
+        , id(id) {
+    }
+
+    //! Returns the kind of this node
+    [[nodiscard]] NodeKind getKind() const {
+        return kind;
     }
 
-    /// Returns the ID of the cone this @ref TMRGraphNode belongs to
+    //! Returns true if this node is a terminal of the search, i.e. an IONode or an FFNode
+    [[nodiscard]] bool isTerminal() const {
+        return kind == NodeKind::IO || kind == NodeKind::FF;
+    }
+
+    //! Identifies this node (for debug)
+    [[nodiscard]] const char *identify() const {
+        switch (kind) {
+        case NodeKind::ElementCell:
+            return "ElementCellNode";
+        case NodeKind::FF:
+            return "FFNode";
+        case NodeKind::IO:
+            return "IONode";
+        }
+        return "UnknownNode";
+    }
+
+    /// Returns the ID of the cone this @ref TMRGraphNode belongs to, which is the first cone that found it
     [[nodiscard]] uint32_t getConeID() const {
         return id;
     }
 
-    //! Compute neighbours of this node for the backwards BFS
-    [[nodiscard]] std::vector<TMRGraphNode::Ptr> computeNeighbours(
-        const RTLILWireConnections &connections, const RTLILAnySignalConnections &signalConnections);
+    /// Returns the index of the underlying RTLIL object in the original @ref NetlistGraph, or @ref
+    /// INVALID_NODE if it has no connections
+    [[nodiscard]] NodeIndex getIndex() const {
+        return index;
+    }
 
     //! Gets a pointer to the underlying RTLIL object
     virtual RTLILAnyPtr getRTLILObjPtr() = 0;
@@ -63,15 +99,16 @@ public:
     //! Gets the underlying SigSpecs that may be attached to this node, if relevant
     virtual std::vector<RTLIL::SigSpec> getSigSpecs() = 0;
 
-    //! Replicates the node in the RTLIL netlist
-    virtual void replicate(RTLIL::Module *module) = 0;
-
-    //! Identifies this node (for debug)
-    virtual std::string identify() = 0;
+    //! Replicates the node in the RTLIL netlist, recording the new replicas in the journal
+    virtual void replicate(RTLIL::Module *module, EditJournal &journal) = 0;
 
     //! Returns replicas, if this is supported (not supported on IONode, which cannot be replicated).
     virtual std::vector<RTLILAnyPtr> getReplicas() = 0;
 
+    //! Records the two replicas of this node, when they were made by @ref LogicCone::replicate rather than
+    //! by @ref replicate. Not supported on IONode.
+    virtual void setReplicas(const RTLILAnyPtr &replica1, const RTLILAnyPtr &replica2) = 0;
+
     //! Returns the width of the wire if this makes sense, otherwise throws an error
     virtual int getWidth() = 0;
 
@@ -87,13 +124,14 @@ public:
     }
 
 private:
+    //! Kind of node, this never changes
+    NodeKind kind;
+
+    //! Index of the RTLIL object in the original NetlistGraph
+    NodeIndex index;
+
     //! ID of the cone that this TMRGraphNode belongs to
     uint32_t id;
-
-    //! During LogicCone::computeNeighbours, this call turns an RTLIL neighbour (ptr) into a new logic graph
-    //! node, with the parent correctly set to this TMRGraphNode using getSelfPtr().
-    [[nodiscard]] TMRGraphNode::Ptr newLogicGraphNeighbour(
-        const RTLILAnyPtr &ptr, const RTLILWireConnections &wireConnections) const;
 };
 
 //! Logic element in the graph, between an FFNode and/or an IONode
@@ -101,13 +139,13 @@ class ElementCellNode : public TMRGraphNode {
     friend class FFNode;
 
 public:
-    explicit ElementCellNode(RTLIL::Cell *cell, uint32_t id)
-        : TMRGraphNode(id)
+    ElementCellNode(RTLIL::Cell *cell, NodeIndex index, uint32_t id)
+        : TMRGraphNode(NodeKind::ElementCell, index, id)
         , cell(cell) {
     }
 
-    ElementCellNode(RTLIL::Cell *cell, const std::vector<RTLIL::SigSpec> &spec, uint32_t id)
-        : TMRGraphNode(id)
+    ElementCellNode(RTLIL::Cell *cell, const std::vector<RTLIL::SigSpec> &spec, NodeIndex index, uint32_t id)
+        : TMRGraphNode(NodeKind::ElementCell, index, id)
         , cell(cell) {
         for (const auto &sig : spec) {
             sigSpecs.push_back(sig);
@@ -118,11 +156,7 @@ public:
         return cell;
     }
 
-    void replicate(RTLIL::Module *module) override;
-
-    std::string identify() override {
-        return "ElementCellNode";
-    }
+    void replicate(RTLIL::Module *module, EditJournal &journal) override;
 
     RTLILAnyPtr getRTLILObjPtr() override {
         return cell;
@@ -141,6 +175,10 @@ public:
         return out;
     }
 
+    void setReplicas(const RTLILAnyPtr &replica1, const RTLILAnyPtr &replica2) override {
+        replicas = { std::get<RTLIL::Cell *>(replica1), std::get<RTLIL::Cell *>(replica2) };
+    }
+
     int getWidth() override {
         log_error("TaMaRa internal error: Cannot get width of an ElementCellNode!\n");
     }
@@ -150,98 +188,44 @@ public:
         // return std::hash<std::string>()(cell->name.c_str());
     }
 
-private:
-    RTLIL::Cell *cell;
-    std::vector<RTLIL::SigSpec> sigSpecs;
-    std::vector<RTLIL::Cell *> replicas;
-};
-
-//! Also a logic element in the graph, but a wire not a cell. See ElementNode.
-class ElementWireNode : public TMRGraphNode {
-public:
-    explicit ElementWireNode(RTLIL::Wire *wire, uint32_t id)
-        : TMRGraphNode(id)
-        , wire(wire) {
-    }
-
-    ElementWireNode(RTLIL::Wire *wire, const std::vector<RTLIL::SigSpec> &spec, uint32_t id)
-        : TMRGraphNode(id)
-        , wire(wire) {
-        for (const auto &sig : spec) {
-            sigSpecs.push_back(sig);
-        }
-    }
-
-    RTLIL::Wire *getWire() const {
-        return wire;
-    }
-
-    void replicate(RTLIL::Module *module) override;
-
-    std::string identify() override {
-        return "ElementWireNode";
-    }
-
-    RTLILAnyPtr getRTLILObjPtr() override {
-        return wire;
-    }
-
-    std::vector<RTLIL::SigSpec> getSigSpecs() override {
-        return sigSpecs;
-    }
-
-    std::vector<RTLILAnyPtr> getReplicas() override {
-        std::vector<RTLILAnyPtr> out {};
-        out.reserve(replicas.size());
-        for (const auto &replica : replicas) {
-            out.emplace_back(replica);
-        }
-        return out;
-    }
-
-    int getWidth() override {
-        return wire->width;
-    }
-
-    size_t hash() const override {
-        return std::hash<RTLIL::Wire *>()(wire);
-        // return std::hash<std::string>()(wire->name.c_str());
+protected:
+    //! Used by @ref FFNode, which is an ElementCellNode of a different kind
+    ElementCellNode(NodeKind kind, RTLIL::Cell *cell, NodeIndex index, uint32_t id)
+        : TMRGraphNode(kind, index, id)
+        , cell(cell) {
     }
 
 private:
-    RTLIL::Wire *wire;
+    RTLIL::Cell *cell;
     std::vector<RTLIL::SigSpec> sigSpecs;
-    std::vector<RTLIL::Wire *> replicas;
+    std::vector<RTLIL::Cell *> replicas;
 };
 
 //! Flip flop node in the graph
 class FFNode : public ElementCellNode {
     // functionally identical to ElementNode, we just need the class to distinguish from ElementNode
 public:
-    explicit FFNode(RTLIL::Cell *cell, uint32_t id)
-        : ElementCellNode(cell, id) {
+    FFNode(RTLIL::Cell *cell, NodeIndex index, uint32_t id)
+        : ElementCellNode(NodeKind::FF, cell, index, id) {
     }
 
     RTLIL::Cell *getFF() {
         return cell;
     }
-
-    std::string identify() override {
-        return "FFNode";
-    }
 };
 
 //! IO port node in the graph. An IONode must be at the end, so it has no neighbours, it's a direct IO to the
-//! FPGA/ASIC output.
+//! FPGA/ASIC output. Wires are only in the graph if they're module ports or hardened instance inputs, as the
+//! cells are connected straight to each other, so every wire in the graph is an IONode.
 class IONode : public TMRGraphNode {
 public:
-    explicit IONode(RTLIL::Wire *io, uint32_t id)
-        : TMRGraphNode(id)
+    IONode(RTLIL::Wire *io, NodeIndex index, uint32_t id)
+        : TMRGraphNode(NodeKind::IO, index, id)
         , io(io) {
     }
 
-    IONode(RTLIL::Wire *io, const std::vector<RTLIL::SigSpec> &spec, uint32_t id)
-        : TMRGraphNode(id)
+    IONode(RTLIL::Wire *io, const std::vector<RTLIL::SigSpec> &spec, NodeIndex index, uint32_t id)
+        : TMRGraphNode(NodeKind::IO, index, id)
         , io(io) {
         for (const auto &sig : spec) {
             sigSpecs.push_back(sig);
@@ -252,11 +236,7 @@ public:
         return io;
     }
 
-    void replicate(RTLIL::Module *module) override;
-
-    std::string identify() override {
-        return "IONode";
-    }
+    void replicate(RTLIL::Module *module, EditJournal &journal) override;
 
     RTLILAnyPtr getRTLILObjPtr() override {
         return io;
@@ -270,6 +250,11 @@ public:
         log_error("TaMaRa internal error: Cannot get replicas of an IONode!");
     }
 
+    void setReplicas([[maybe_unused]] const RTLILAnyPtr &replica1,
+        [[maybe_unused]] const RTLILAnyPtr &replica2) override {
+        log_error("TaMaRa internal error: Cannot set replicas of an IONode!");
+    }
+
     int getWidth() override {
         return io->width;
     }
@@ -284,68 +269,190 @@ private:
     std::vector<RTLIL::SigSpec> sigSpecs;
 };
 
+//! Owns every @ref TMRGraphNode created during a pass, so that each RTLIL object in the @ref NetlistGraph has
+//! exactly one node, no matter how many cones find it. Nodes are allocated from a monotonic arena and are
+//! all freed at once when the pool is destroyed, so the pool must outlive every cone that uses it.
+class NodePool {
+public:
+    explicit NodePool(const NetlistGraph &graph)
+        : graph(graph)
+        , nodes(graph.size()) {
+    }
+
+    NodePool(const NodePool &) = delete;
+
+    NodePool(NodePool &&) = delete;
+
+    NodePool &operator=(const NodePool &) = delete;
+
+    NodePool &operator=(NodePool &&) = delete;
+
+    ~NodePool() = default;
+
+    //! Returns the node for the object at the given index, creating it in the given cone if it's the first
+    //! time the object has been seen
+    [[nodiscard]] TMRGraphNode::Ptr get(NodeIndex index, uint32_t coneID);
+
+    //! Same as above, but looks up the object first. Objects that are not in the graph have no connections,
+    //! so they get a fresh node that isn't pooled.
+    [[nodiscard]] TMRGraphNode::Ptr get(const RTLILAnyPtr &ptr, uint32_t coneID);
+
+    //! Returns the graph that nodes are looked up in
+    [[nodiscard]] const NetlistGraph &getGraph() const {
+        return graph;
+    }
+
+private:
+    const NetlistGraph &graph;
+    //! Declared before the nodes so that it's destroyed after them
+    std::pmr::monotonic_buffer_resource arena;
+    //! Indexed by NodeIndex
+    std::vector<TMRGraphNode::Ptr> nodes;
+
+    //! Allocates the right kind of node for the RTLIL object in the arena
+    [[nodiscard]] TMRGraphNode::Ptr create(const RTLILAnyPtr &ptr, NodeIndex index, uint32_t coneID);
+};
+
+//! Replicas of the original netlist made so far. This is shared by every cone of a module, so that a cone
+//! which reads a signal replicated by an earlier cone reads the matching replica, rather than the original.
+struct ReplicaMap {
+    //! Bits driven by replicated cells that haven't been voted yet, normalised through the SigMap of
+    //! @ref RTLILConnections, mapped to the same bit in each of the two replicas. Voted bits are removed, so
+    //! that everything which reads them afterwards reads the voter output instead.
+    ankerl::unordered_dense::map<RTLIL::SigBit, std::array<RTLIL::SigBit, 2>> bits;
+    //! Wires of the original netlist mapped to their two copies, which hold the replica bits. A wire is only
+    //! copied the first time a replicated cell drives one of its bits.
+    ankerl::unordered_dense::map<RTLIL::Wire *, std::array<RTLIL::Wire *, 2>> wires;
+};
+
+//! Decides which logic cones get a voter, trading voter area and delay against how quickly an upset is
+//! corrected. Cones rooted at the module outputs are always voted, otherwise every replica would drive the
+//! output port.
+struct VoterPolicy {
+    enum class Kind : uint8_t {
+        //! Vote in every cone, i.e. after every FF
+        FF,
+        //! Vote in cones whose root is a multiple of `interval` FFs away from an output
+        Every,
+        //! Only vote at the outputs
+        Outputs,
+        //! Only vote at the outputs, and in cones whose root FF (or the wire it drives) is marked
+        //! (* tamara_vote *)
+        Annotated,
+    };
+
+    Kind kind = Kind::FF;
+    uint32_t interval = 1;
+};
+
+//! Parses the argument of `tamara_tmr -voters`, returning nothing if it isn't a valid policy
+std::optional<VoterPolicy> parseVoterPolicy(const std::string &policy);
+
 //! Encapsulates the logic elements between two FFs, or two IO ports, or an IO port and an FF
 class LogicCone {
 public:
-    //! Instantiates a new logic cone from the starting output wire.
-    explicit LogicCone(RTLIL::Wire *io)
-        : outputNode(std::make_shared<IONode>(io, nextID()))
-        , id(outputNode->getConeID()) {
+    //! Instantiates a new logic cone from the starting output wire. The nodes of the cone come from the pool.
+    LogicCone(RTLIL::Wire *io, NodePool &pool)
+        : pool(&pool)
+        , id(nextID()) {
+        outputNode = pool.get(io, id);
         insertFixWalkers();
     }
 
-    //! Instantiates a new logic cone from the intermediate flip-flop cell.
-    LogicCone(RTLIL::Cell *ff)
-        : outputNode(std::make_shared<FFNode>(ff, nextID()))
-        , id(outputNode->getConeID()) {
+    //! Instantiates a new logic cone from the intermediate flip-flop cell. The nodes of the cone come from
+    //! the pool.
+    LogicCone(RTLIL::Cell *ff, NodePool &pool)
+        : pool(&pool)
+        , id(nextID()) {
         if (!isDFF(ff)) {
             log_error("TaMaRa internal error: Tried to instantiate LogicCone with non-DFF cell '%s'!\n",
                 log_id(ff->name));
         }
+        outputNode = pool.get(ff, id);
         insertFixWalkers();
     }
 
-    //! Builds a logic cone by tracing backwards from outputNode to either a DFF or other IO.
-    void search(const RTLILConnections &connections);
-
-    //! Replicates the RTLIL components in a logic cone
-    void replicate(RTLIL::Module *module);
-
-    //! Wires up the replicated components and the module, and inserts a voter
-    void wire(RTLIL::Module *module, const RTLILConnections &connections, VoterBuilder &builder);
-
-    //! Builds a new logic cone that will continue the search onwards, or none if we're already at the input
-    std::vector<LogicCone> buildSuccessors(const RTLILConnections &connections);
+    //! Partitions the whole module into logic cones. Cones are rooted at the given outputs, and at every FF
+    //! that feeds a cone. Each element belongs to the cone with the lowest-numbered root that reaches it,
+    //! and the returned cones are in root order, which is also the order they must be replicated and wired
+    //! in.
+    //!
+    //! Roots are processed in waves: the outputs, then the FFs found by the outputs, and so on. With one
+    //! thread this is a single O(V + E) sweep. With more, the cones of each wave are searched concurrently,
+    //! then merged one at a time in root order, so the result is identical no matter how many threads are
+    //! used.
+    static std::vector<LogicCone> partition(const std::vector<RTLIL::Wire *> &outputs,
+        const RTLILConnections &connections, NodePool &pool, size_t threads = 1);
+
+    //! Returns the number of elements that belong to this cone
+    [[nodiscard]] size_t size() const {
+        return cone.size();
+    }
+
+    //! Decides which of the cones returned by @ref partition get a voter. This only looks at the cones, so
+    //! it must run before any of them are replicated.
+    static void applyVoterPolicy(std::vector<LogicCone> &cones, const VoterPolicy &policy);
+
+    //! Replicates the RTLIL components in a logic cone: its elements, its root if that's an FF, and the FFs
+    //! it reads, unless an earlier cone got to them first. Every bit they drive gets a replica in each copy,
+    //! and the ports of each copy are wired to the other copies of the same replica, and to the replicas of
+    //! earlier cones, through the replica map.
+    void replicate(const RTLILConnections &connections, EditJournal &journal, ReplicaMap &replicas);
+
+    //! Inserts a voter for the replicated bits that the root of this cone reads, and wires up the root. The
+    //! connections are the snapshot of the original netlist. Bits voted by an earlier cone are already
+    //! gone from the replica map, so they aren't voted again. The edits made here, and by @ref replicate,
+    //! are committed before the fix walkers run.
+    void wire(RTLIL::Module *module, const RTLILConnections &connections, EditJournal &journal,
+        VoterBuilder &builder, ReplicaMap &replicas);
 
 private:
+    /// pool that every node in this cone comes from
+    NodePool *pool;
+
     /// this is the list of terminals: the list of IO nodes or FF nodes that we end up on through our
-    /// backwards ! BFS. when we reach a terminal, we try and finalise the search by not adding any more nodes
-    /// from that ! terminal. however, we could still encounter multiple terminals, hence the list.
+    /// backwards BFS. when we reach a terminal, we don't add any more nodes from that terminal. however, we
+    /// could still encounter multiple terminals, hence the list.
     std::vector<TMRGraphNode::Ptr> inputNodes;
 
     /// output node of the cone; a cone has only one output (at the moment)
     TMRGraphNode::Ptr outputNode;
 
-    /// list of logic cone elements, to be replicated (does not include terminals)
+    /// list of logic cone elements, to be replicated (does not include terminals, or elements owned by an
+    /// earlier cone)
     std::vector<TMRGraphNode::Ptr> cone;
 
-    /// voter cut point (i.e. where to wire the voter), this is the first node found on the backwards BFS
-    std::optional<TMRGraphNode::Ptr> voterCutPoint;
-
-    /// BFS frontier
-    std::queue<TMRGraphNode::Ptr> frontier;
-
     /// logic cone ID, mostly used to identify this cone for debug
     uint32_t id;
 
-    //! Verifies all terminals in LogicCone::search are legal.
+    /// number of FFs between the root of this cone and an output, along the path it was found on
+    uint32_t depth = 0;
+
+    /// whether a voter is inserted at the root, as decided by the voter policy
+    bool voted = true;
+
+    //! Verifies all terminals found by LogicCone::partition are legal.
     void verifyInputNodes() const;
 
-    //! From a node under consideration, inserts a voter into the cone.
-    //! @param replicas Replicas for this node, should be of length 3 (includes the node itself).
-    //! @returns The output wire, or none if no voter was inserted.
-    std::optional<RTLIL::Wire *> insertVoter(
-        VoterBuilder &builder, const std::vector<RTLILAnyPtr> &replicas, const RTLILConnections &connections);
+    //! Copies each of the cells into two replicas. Each copy of a cell drives the copies of the wires its
+    //! outputs are connected to, instead of the original wires, and reads the copies of any bit that has been
+    //! replicated so far.
+    void cloneElements(const std::vector<TMRGraphNode::Ptr> &nodes, const RTLILConnections &connections,
+        EditJournal &journal, ReplicaMap &replicas);
+
+    //! Returns the bits the root of this cone reads which are driven by replicas that haven't been voted,
+    //! normalised and without duplicates
+    [[nodiscard]] std::vector<RTLIL::SigBit> findVoteBits(
+        const RTLILConnections &connections, const ReplicaMap &replicas) const;
+
+    //! Returns true if the root of this cone, or a wire driven by it, is marked (* tamara_vote *)
+    [[nodiscard]] bool hasVoteAnnotation() const;
+
+    //! Inserts a voter between the bits and their replicas. The cell that drives each original bit is moved
+    //! onto the first input of the voter, and the voter drives the original bit instead. The bits are
+    //! removed from the replica map.
+    void insertVoter(const std::vector<RTLIL::SigBit> &bits, VoterBuilder &builder, EditJournal &journal,
+        ReplicaMap &replicas);
 
     FixWalkerManager fixWalkers;
     // PERF This might be a little non-optimal, should be static
@@ -359,11 +466,6 @@ private:
     static uint32_t nextID() {
         return g_cone_ID++;
     }
-
-    /// Contains the names of starting nodes for cones we've already discovered in @ref
-    /// LogicCone::buildSuccessors. This is to stop us from infinite looping when we discover new successor
-    /// cones.
-    static ankerl::unordered_dense::set<std::string> g_explored_successors;
 };
 
 } // namespace tamara
@@ -0,0 +1,49 @@
+// TaMaRa: An automated triple modular redundancy EDA flow for Yosys.
+//
+// Copyright (c) 2025 Matt Young.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
+// was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#pragma once
+#include "kernel/mem.h"
+#include "kernel/yosys_common.h"
+#include "tamara/edit_journal.hpp"
+#include "tamara/voter_builder.hpp"
+#include <cstdint>
+#include <optional>
+#include <string>
+
+USING_YOSYS_NAMESPACE;
+
+namespace tamara {
+
+//! How often the scrubber added by `tamara_tmr -scrub_rate` rewrites a word of a triplicated memory, and how
+//! it shares the memory with the rest of the design
+struct ScrubPolicy {
+    enum class Arbitration : uint8_t {
+        //! Only scrub in cycles where none of the design's write ports are enabled
+        Idle,
+        //! Scrub regardless of the design's write ports. The scrubber reads the data written in the same
+        //! cycle, and the design's writes take priority over the scrubber's.
+        Always,
+    };
+
+    //! Scrub one word at most every this many cycles, or never if 0
+    uint32_t rate = 0;
+    Arbitration arbitration = Arbitration::Idle;
+};
+
+//! Parses the argument of `tamara_tmr -scrub_policy`, returning nothing if it isn't a valid policy
+std::optional<ScrubPolicy::Arbitration> parseScrubArbitration(const std::string &arbitration);
+
+//! Adds a scrubber to a memory that is about to be triplicated. It walks the addresses of the memory, reading
+//! one word through a new read port, and writing it back through a new write port on the next cycle.
+//!
+//! The data of the new read port is a wire that also drives the data of the new write port, so once the
+//! memory is triplicated and its read ports are voted, the voted word is written back to all three copies.
+//! The scrubber is clocked by the write ports, which must all be synchronous and share a clock. Its registers
+//! are triplicated and voted by the builder, which also collects their error signals. Returns false, without
+//! changing the memory, if it can't be scrubbed.
+bool addScrubber(EditJournal &journal, VoterBuilder &builder, Mem &mem, const ScrubPolicy &policy);
+
+} // namespace tamara
@@ -0,0 +1,173 @@
+// TaMaRa: An automated triple modular redundancy EDA flow for Yosys.
+//
+// Copyright (c) 2025 Matt Young.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
+// was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#pragma once
+#include "ankerl/unordered_dense.hpp"
+#include "kernel/rtlil.h"
+#include "kernel/yosys_common.h"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <variant>
+#include <vector>
+
+USING_YOSYS_NAMESPACE;
+
+namespace tamara {
+
+//! Pointer to an RTLIL wire or cell (not strictly "any", but for our use case it suffices)
+using RTLILAnyPtr = std::variant<RTLIL::Wire *, RTLIL::Cell *>;
+
+//! Dense index of an RTLIL wire or cell inside a @ref NetlistGraph
+using NodeIndex = uint32_t;
+
+//! Returned by @ref NetlistGraph::find when an RTLIL object is not part of the graph
+constexpr NodeIndex INVALID_NODE = std::numeric_limits<NodeIndex>::max();
+
+//! Compact graph of the connections between wires and cells in a module.
+//!
+//! Every wire or cell that participates in a connection is numbered densely from 0, and the adjacency is
+//! stored as compressed sparse row (CSR) arrays. The forward direction is the same as the one recorded by
+//! @ref analyseConnections, i.e. from a node to the objects that feed it (the direction of the backwards
+//! BFS). The inverse direction is stored as well, so that reverse lookups are O(degree).
+class NetlistGraph {
+public:
+    //! Builder used to construct a @ref NetlistGraph from a list of edges
+    class Builder {
+    public:
+        //! Numbers the RTLIL object, if it has not already been numbered, and returns its index
+        NodeIndex addNode(const RTLILAnyPtr &ptr);
+
+        //! Adds an edge from -> to. Duplicate edges are ignored, and insertion order is preserved.
+        void addEdge(const RTLILAnyPtr &from, const RTLILAnyPtr &to);
+
+        //! Returns the number of unique edges added so far
+        [[nodiscard]] size_t edgeCount() const {
+            return edges.size();
+        }
+
+        //! Consumes the builder and constructs the CSR arrays
+        [[nodiscard]] NetlistGraph build();
+
+    private:
+        std::vector<RTLILAnyPtr> nodes;
+        ankerl::unordered_dense::map<RTLILAnyPtr, NodeIndex> indices;
+        std::vector<std::pair<NodeIndex, NodeIndex>> edges;
+        ankerl::unordered_dense::set<uint64_t> seenEdges;
+    };
+
+    NetlistGraph() = default;
+
+    //! Returns the number of nodes in the graph
+    [[nodiscard]] size_t size() const {
+        return nodes.size();
+    }
+
+    //! Returns the number of edges in the graph
+    [[nodiscard]] size_t edgeCount() const {
+        return forwardTargets.size();
+    }
+
+    //! Returns the index of the RTLIL object, or @ref INVALID_NODE if it is not in the graph
+    [[nodiscard]] NodeIndex find(const RTLILAnyPtr &ptr) const {
+        auto it = indices.find(ptr);
+        return it == indices.end() ? INVALID_NODE : it->second;
+    }
+
+    //! Returns true if the RTLIL object is in the graph
+    [[nodiscard]] bool contains(const RTLILAnyPtr &ptr) const {
+        return indices.contains(ptr);
+    }
+
+    //! Returns the RTLIL object for the given node index
+    [[nodiscard]] const RTLILAnyPtr &node(NodeIndex index) const {
+        return nodes.at(index);
+    }
+
+    //! Returns the forward neighbours (the objects feeding this node) as a contiguous range
+    [[nodiscard]] std::span<const NodeIndex> neighbours(NodeIndex index) const {
+        return { forwardTargets.data() + forwardOffsets.at(index),
+            forwardTargets.data() + forwardOffsets.at(index + 1) };
+    }
+
+    //! Same as @ref neighbours, but looks up the node first. Returns an empty range if it's not present.
+    [[nodiscard]] std::span<const NodeIndex> neighbours(const RTLILAnyPtr &ptr) const {
+        auto index = find(ptr);
+        return index == INVALID_NODE ? std::span<const NodeIndex>() : neighbours(index);
+    }
+
+    //! Returns the inverse neighbours (the objects this node feeds) as a contiguous range
+    [[nodiscard]] std::span<const NodeIndex> inverseNeighbours(NodeIndex index) const {
+        return { backwardTargets.data() + backwardOffsets.at(index),
+            backwardTargets.data() + backwardOffsets.at(index + 1) };
+    }
+
+    //! Same as @ref inverseNeighbours, but looks up the node first. Returns an empty range if it's not
+    //! present.
+    [[nodiscard]] std::span<const NodeIndex> inverseNeighbours(const RTLILAnyPtr &ptr) const {
+        auto index = find(ptr);
+        return index == INVALID_NODE ? std::span<const NodeIndex>() : inverseNeighbours(index);
+    }
+
+    //! Converts a range of node indices back into RTLIL objects
+    [[nodiscard]] std::vector<RTLILAnyPtr> resolve(std::span<const NodeIndex> range) const;
+
+private:
+    std::vector<RTLILAnyPtr> nodes;
+    ankerl::unordered_dense::map<RTLILAnyPtr, NodeIndex> indices;
+
+    //! CSR offsets, of length size() + 1
+    std::vector<uint32_t> forwardOffsets;
+    std::vector<NodeIndex> forwardTargets;
+
+    std::vector<uint32_t> backwardOffsets;
+    std::vector<NodeIndex> backwardTargets;
+};
+
+//! Set of node indices that can be cleared in O(1). Each member is stamped with the current epoch, and
+//! clearing the set just starts a new epoch. This is used for the visited sets of searches that run many
+//! times over the same graph.
+class EpochSet {
+public:
+    //! Makes room for node indices up to size - 1, so that inserting them doesn't have to grow the set
+    void reserve(size_t size) {
+        if (stamps.size() < size) {
+            stamps.resize(size, 0);
+        }
+    }
+
+    //! Removes every member
+    void clear() {
+        epoch++;
+        // on the (very unlikely) wraparound, stale stamps could match again, so really clear them
+        if (epoch == 0) {
+            std::fill(stamps.begin(), stamps.end(), 0);
+            epoch = 1;
+        }
+    }
+
+    //! Returns true if the index is a member
+    [[nodiscard]] bool contains(NodeIndex index) const {
+        return index < stamps.size() && stamps[index] == epoch;
+    }
+
+    //! Adds the index, returning true if it wasn't already a member
+    bool insert(NodeIndex index) {
+        reserve(static_cast<size_t>(index) + 1);
+        if (stamps[index] == epoch) {
+            return false;
+        }
+        stamps[index] = epoch;
+        return true;
+    }
+
+private:
+    std::vector<uint32_t> stamps;
+    uint32_t epoch = 1;
+};
+
+} // namespace tamara
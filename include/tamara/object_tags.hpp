@@ -0,0 +1,86 @@
+// TaMaRa: An automated triple modular redundancy EDA flow for Yosys.
+//
+// Copyright (c) 2025 Matt Young.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
+// was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#pragma once
+#include "ankerl/unordered_dense.hpp"
+#include "kernel/rtlil.h"
+#include "kernel/yosys_common.h"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+USING_YOSYS_NAMESPACE;
+
+namespace tamara {
+
+//! Side table of what TaMaRa knows about the objects it replicates and creates: which cone they were
+//! replicated in, whether they're an original or a replica, and whether they're part of a voter.
+//!
+//! Setting an RTLIL attribute allocates a Const and inserts into a per-object dict, so while the pass runs
+//! this is kept here instead, and only written out to attributes once at the end by @ref writeAttributes.
+//!
+//! The innermost live table is registered as the active one, so that debug dumps can colour the cones
+//! without the journal being threaded through to them.
+class ObjectTags {
+public:
+    enum class Role : uint8_t {
+        //! An object that has been replicated
+        Original,
+        //! A copy of an original
+        Replica,
+        //! Part of a voter or the error tree
+        Voter,
+    };
+
+    ObjectTags();
+    ~ObjectTags();
+    ObjectTags(const ObjectTags &) = delete;
+    ObjectTags &operator=(const ObjectTags &) = delete;
+    ObjectTags(ObjectTags &&) = delete;
+    ObjectTags &operator=(ObjectTags &&) = delete;
+
+    //! Returns the innermost live table, or nullptr if there isn't one
+    [[nodiscard]] static const ObjectTags *active();
+
+    //! Tags an original or replica with the cone it was replicated in
+    void tagReplicated(RTLIL::AttrObject *obj, Role role, uint32_t cone);
+
+    //! Tags an object as part of a voter
+    void tagVoter(RTLIL::AttrObject *obj);
+
+    //! Returns the cone the object was replicated in, or nothing if it hasn't been replicated
+    [[nodiscard]] std::optional<uint32_t> getCone(RTLIL::AttrObject *obj) const;
+
+    //! Returns true if the object is an original or replica, either tagged here or marked by an earlier run
+    //! of the pass
+    [[nodiscard]] bool isReplicated(RTLIL::AttrObject *obj) const;
+
+    //! Returns the number of tagged objects
+    [[nodiscard]] size_t size() const {
+        return tags.size();
+    }
+
+    //! Writes the tags out as attributes. Voters always get (* tamara_voter *), as fault injection relies on
+    //! it to avoid upsetting them. Originals always get (* tamara_original *) and replicas
+    //! (* tamara_replica *), so that running the pass again leaves them alone. Only if cones is set do both
+    //! get (* tamara_cone *), otherwise it's removed, as debug dumps write it while the pass runs.
+    void writeAttributes(bool cones) const;
+
+private:
+    //! Cone of objects that haven't been replicated
+    static constexpr uint32_t NO_CONE = UINT32_MAX;
+
+    struct Tag {
+        uint32_t cone;
+        Role role;
+    };
+
+    ankerl::unordered_dense::map<RTLIL::AttrObject *, Tag> tags;
+    //! The table that was active before this one
+    const ObjectTags *previous;
+};
+
+} // namespace tamara
@@ -7,11 +7,35 @@
 #pragma once
 #include "ankerl/unordered_dense.hpp"
 #include "kernel/rtlil.h"
+#include "kernel/sigtools.h"
 #include "kernel/yosys_common.h"
+#include "tamara/cell_ports.hpp"
+#include "tamara/netlist_graph.hpp"
 #include <variant>
+#include <vector>
 
 USING_YOSYS_NAMESPACE;
 
+namespace std {
+template <>
+struct hash<RTLIL::SigSpec> {
+    std::size_t operator()(const RTLIL::SigSpec &k) const {
+        Hasher h;
+        h = k.hash_into(h);
+        return h.yield();
+    }
+};
+
+template <>
+struct hash<RTLIL::SigBit> {
+    std::size_t operator()(const RTLIL::SigBit &k) const {
+        Hasher h;
+        h = k.hash_into(h);
+        return h.yield();
+    }
+};
+}; // namespace std
+
 //! The main TaMaRa namespace
 namespace tamara {
 
@@ -65,35 +89,111 @@ const auto CONE_ANNOTATION = ID(tamara_cone);
 const auto ORIGINAL_ANNOTATION = ID(tamara_original);
 const auto VOTER_ANNOTATION = ID(tamara_voter);
 const auto ERROR_SINK_ANNOTATION = ID(tamara_error_sink);
+const auto VOTE_ANNOTATION = ID(tamara_vote);
+//! Marks a wire that drives an input of a hardened instance in hierarchical mode. It's treated like an
+//! output port, so the logic driving it is triplicated and voted before it enters the instance.
+const auto INSTANCE_INPUT_ANNOTATION = ID(tamara_instance_input);
 
-//! Pointer to an RTLIL wire or cell (not strictly "any", but for our use case it suffices)
-using RTLILAnyPtr = std::variant<RTLIL::Wire *, RTLIL::Cell *>;
+//! Type of the voter cell inserted by `tamara_tmr -voter_cell`, which is lowered by src/tmr_voter_map.v or
+//! src/tmr_voter_lut3_map.v. It has WIDTH bit ports A, B, C (in), Y (voted) and ERR (per bit mismatch).
+const auto VOTER_CELL_TYPE = ID($__tmr_voter);
 
 //! Unordered set of @ref RTLILAnyPtr
 using RTLILAnyPtrSet = ankerl::unordered_dense::set<RTLILAnyPtr>;
 
-//! Unordered set of @ref RTLIL::SigSpec
-using RTLILSigSpecSet = ankerl::unordered_dense::set<RTLIL::SigSpec>;
+//! Representation of connections in the original netlist, which is what the logic cone search runs on
+struct RTLILConnections {
+    //! Graph of connections between cells and IO wires. Each cell, output port and instance input points to
+    //! the cells and input ports that drive the bits it reads.
+    NetlistGraph graph;
+    //! Normalises bits that are aliased by global module connections in the original netlist
+    SigMap sigmap;
+};
 
-//! Mapping of connections between a wire and all RTLIL objects its connected to
-using RTLILWireConnections = ankerl::unordered_dense::map<RTLILAnyPtr, RTLILAnyPtrSet>;
+//! One bit of a port. The owner is either a cell, or a wire if this is a module port.
+struct PortBit {
+    RTLILAnyPtr owner;
+    RTLIL::IdString port;
+    int offset;
 
-//! Mapping of connections between an RTLILAnyPtr and all the RTLIL SigSpecs it is connected to
-using RTLILAnySignalConnections = ankerl::unordered_dense::map<RTLILAnyPtr, RTLILSigSpecSet>;
+    bool operator==(const PortBit &other) const = default;
+};
 
-//! Representation of connections in the original netlist
-struct RTLILConnections {
-    RTLILWireConnections wires;
-    RTLILAnySignalConnections signals;
-    //! Original cell outputs in the original circuit
-    RTLILAnySignalConnections cellOutputs;
+//! Live, bit-precise index of every driver and load in a module. Bits are normalised through a SigMap, so
+//! that bits which are aliased by global module connections share one entry. Unlike @ref RTLILConnections,
+//! which is a snapshot of the original netlist, this is updated in place by EditJournal::commit, so that
+//! fix-up passes can query it without re-analysing the whole module. Each update only touches the bits that
+//! were edited, and a rewritten port is removed from the bits it no longer connects to.
+class ConnectionIndex {
+public:
+    //! Cell outputs and module inputs that drive a bit, and cell inputs and module outputs that read it
+    struct BitConnections {
+        std::vector<PortBit> drivers;
+        std::vector<PortBit> loads;
+    };
+
+    //! Indexes the module in one pass over its cells and ports. The cells are split into up to `threads`
+    //! shards that are classified in parallel, and the result doesn't depend on the number of threads. The
+    //! port oracle must outlive the index.
+    ConnectionIndex(RTLIL::Module *module, const CellPortOracle &ports, size_t threads = 1);
+
+    //! Returns the port direction oracle the index was built with
+    [[nodiscard]] const CellPortOracle &getPorts() const {
+        return ports;
+    }
+
+    //! Returns the drivers and loads of the bit, normalising it first, or nullptr if it has none. The
+    //! pointer is invalidated by any update.
+    [[nodiscard]] const BitConnections *find(const RTLIL::SigBit &bit) const;
+
+    //! Returns every indexed bit, already normalised, with its drivers and loads
+    [[nodiscard]] const ankerl::unordered_dense::map<RTLIL::SigBit, BitConnections> &getBits() const {
+        return bits;
+    }
+
+    //! Returns the SigMap that bits are normalised through
+    [[nodiscard]] const SigMap &getSigMap() const {
+        return sigmap;
+    }
+
+    //! Indexes every port of a cell that was just added to the module
+    void addCell(RTLIL::Cell *cell);
+
+    //! Re-indexes one port of a cell, which was connected to `previous` when it was last indexed. Only the
+    //! bits that differ are updated.
+    void updatePort(RTLIL::Cell *cell, const RTLIL::IdString &port, const RTLIL::SigSpec &previous);
+
+    //! Indexes a new global module connection, which merges the entries of the bits it connects. Call this
+    //! alongside RTLIL::Module::connect.
+    void updateConnection(const RTLIL::SigSpec &lhs, const RTLIL::SigSpec &rhs);
+
+    //! Returns every bit whose drivers or loads changed since the last call, normalised, without
+    //! duplicates, and in the order they were first changed
+    std::vector<RTLIL::SigBit> takeChanged();
+
+private:
+    const CellPortOracle &ports;
+    SigMap sigmap;
+    ankerl::unordered_dense::map<RTLIL::SigBit, BitConnections> bits;
+    std::vector<RTLIL::SigBit> changed;
+    ankerl::unordered_dense::set<RTLIL::SigBit> changedSet;
+
+    //! Adds or removes one port bit to or from the entry of the (unnormalised) bit
+    void update(const RTLIL::SigBit &bit, const PortBit &portBit, bool driver, bool add);
+
+    //! Indexes or unindexes every bit of a cell port, depending on `add`
+    void updateCellPort(
+        RTLIL::Cell *cell, const RTLIL::IdString &port, const RTLIL::SigSpec &signal, bool add);
+
+    //! Records that the entry of the normalised bit changed
+    void markChanged(const RTLIL::SigBit &bit);
 };
 
 //! Returns true if the cell is a DFF.
 bool isDFF(const RTLIL::Cell *cell);
 
-//! Converts a SigSpec to a wire, if possible, <b>otherwise returns nullptr.</b>
-RTLIL::Wire *sigSpecToWire(const RTLIL::SigSpec &sigSpec);
+//! Returns every distinct wire referenced by the SigSpec, in order of first appearance
+std::vector<RTLIL::Wire *> sigSpecWires(const RTLIL::SigSpec &sigSpec);
 
 //! Casts an RTLILAnyPtr to an RTLIL::AttrObject
 constexpr RTLIL::AttrObject *toAttrObject(const RTLILAnyPtr &ptr) {
@@ -127,23 +227,9 @@ constexpr std::array<std::string, 8> CONE_COLOURS = {
 //! Returns the RTLIL ID for a RTLILAnyPtr
 RTLIL::IdString getRTLILName(const RTLILAnyPtr &ptr);
 
-//! Analyses connections betweens wires/cells and the other wires or cells they're connected to
-std::pair<RTLILWireConnections, RTLILAnySignalConnections> analyseConnections(const RTLIL::Module *module);
-
-//! Analyses cell outputs in the original netlist
-RTLILAnySignalConnections analyseCellOutputs(RTLIL::Module *module);
-
-//! Performs a combination of @ref analyseConnections, @ref analyseSignalConnections and @ref
-//! analyseCellOutputs
-RTLILConnections analyseAll(RTLIL::Module *module);
-
-//! RTLILWireConnections maps a -> (b, c, d, e); but what this function does is find "a" given say b, or c, or
-//! d. Returns empty list if no results found.
-std::vector<RTLILAnyPtr> rtlilInverseLookup(const RTLILWireConnections &connections, Wire *target);
-
-//! Same as @ref rtlilInverseLookup, but for @ref RTLILAnySignalConnections
-std::vector<RTLILAnyPtr> signalInverseLookup(
-    const RTLILAnySignalConnections &connections, const RTLIL::SigSpec &target);
+//! Snapshots the connections of the module from its connection index, which must not have been edited yet.
+//! This is one pass over the bits of the index, plus the wires marked (* tamara_instance_input *).
+RTLILConnections analyseConnections(RTLIL::Module *module, const ConnectionIndex &index);
 
 //! Called by the @ref DUMPASYNC macro to write out a dump to disk. Do not invoke manually.
 void dumpAsync(const std::string &file, const std::string &function, size_t line);
@@ -151,21 +237,27 @@ void dumpAsync(const std::string &file, const std::string &function, size_t line
 //! Generates random hex characters of the output length len
 std::string generateRandomHex(size_t len);
 
-//! Generates a TaMaRa formatted RTLIL::IdString
+//! Generates a TaMaRa formatted RTLIL::IdString. With compact names, this is a short base-36 ID that
+//! doesn't include the name.
 RTLIL::IdString tamaraId(const std::string &name);
 
-//! Gets, or generates if required, the string of colours to pass to the 'show' command
+//! Enables or disables compact names, and clears the name map. Every name TaMaRa generates is interned in
+//! Yosys' global IdString table for good, so on large designs long replica names add up.
+void setCompactNames(bool compact);
+
+//! Generates the name of one of the two replicas (1 or 2) of an object in a logic cone. This is normally the
+//! original name with a suffix. With compact names, it's a short base-36 ID, and the original is recorded
+//! in the name map instead.
+RTLIL::IdString replicaId(const RTLIL::IdString &original, int replica, uint32_t cone);
+
+//! Returns the part of a name generated by @ref replicaId that says which replica it is
+std::string replicaMarker(int replica);
+
+//! Writes the name map recorded with compact names to a JSON file, mapping each replica to its original
+void writeNameMap(const std::string &path);
+
+//! Gets, or generates if required, the string of colours to pass to the 'show' command. The cones are
+//! coloured by their (* tamara_cone *) attribute, so the tags of the active journal are written out first.
 std::string generateColours();
 
 } // namespace tamara
-
-namespace std {
-template <>
-struct hash<RTLIL::SigSpec> {
-    std::size_t operator()(const RTLIL::SigSpec &k) const {
-        Hasher h;
-        h = k.hash_into(h);
-        return h.yield();
-    }
-};
-}; // namespace std
@@ -5,39 +5,93 @@
 // This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
 // was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #pragma once
+#include "kernel/log.h"
 #include "kernel/rtlil.h"
 #include "kernel/yosys_common.h"
+#include "tamara/edit_journal.hpp"
+#include "tamara/util.hpp"
 #include <cstddef>
+#include <cstdint>
 
 USING_YOSYS_NAMESPACE;
 
 namespace tamara {
 
+//! How each voter is built
+enum class VoterStyle : uint8_t {
+    //! A separate network of 1-bit logic gates for every bit
+    Gate,
+    //! One network of multi-bit $and/$or/$xor cells for the whole signal
+    Word,
+    //! One $__tmr_voter cell for the whole signal, which is technology mapped after TMR
+    Cell,
+};
+
 //! Used to build and insert voters into a Yosys RTLIL design.
 class VoterBuilder {
 public:
-    //! Instantiates a new voter builder for the specified module
-    VoterBuilder(RTLIL::Module *module)
-        : module(module) {
+    //! Instantiates a new voter builder for the module of the journal. Every wire, cell and connection the
+    //! builder inserts goes through the journal, so it must be committed before the voters are used.
+    explicit VoterBuilder(EditJournal &journal, VoterStyle style = VoterStyle::Gate)
+        : module(journal.getModule())
+        , journal(&journal)
+        , style(style) {
     }
 
     //! Insert one voter into the design. The voter will use the number of bits in the input wires.
     //! You specify the `a, b` and `c` wires, as well as the output wire.
     void build(RTLIL::Wire *a, RTLIL::Wire *b, RTLIL::Wire *c, RTLIL::Wire *out);
 
+    //! Adds a 1-bit error signal that doesn't come from a voter built here, e.g. the error output of an
+    //! instance of a module that has already been hardened. It's OR'd into the final error signal along with
+    //! the voters. `latency` is the number of cycles the signal already lags behind the error it reports.
+    void addErrorSource(RTLIL::Wire *err, size_t latency = 0);
+
+    //! Sets the maximum number of error signals OR'd together by each node of the error tree built by
+    //! @ref finalise, which must be at least 2. The error path then has a depth of log_fanIn(voters). 0 uses
+    //! a single $reduce_or over all of them instead. Default: 2
+    void setErrorFanIn(size_t fanIn) {
+        errorFanIn = fanIn;
+    }
+
+    //! Registers the outputs of every `every` levels of the error tree built by @ref finalise, as well as its
+    //! root, using $dff cells clocked by the rising edge of `clock`. The tree then adds max(1, ceil(depth /
+    //! every)) cycles of latency, where depth is the depth of the tree. 0 disables pipelining. Default: 0
+    void setErrorPipeline(size_t every, RTLIL::Wire *clock) {
+        log_assert((every == 0 || clock != nullptr) && "Pipelined error tree needs a clock");
+        errorPipelineEvery = every;
+        errorClock = every == 0 ? nullptr : clock;
+    }
+
     //! Finalises all of the voters in this module by OR'ing together all the intermediate error signals into
-    //! a final error signal.
-    void finalise(RTLIL::Wire *err);
+    //! a final error signal, using a balanced tree. Error sources that lag behind the others are delayed to
+    //! match them first, so every error reaches `err` after the same number of cycles, which is returned.
+    size_t finalise(RTLIL::Wire *err);
 
-    //! Returns the number of inserted voters
+    //! Returns the number of inserted voters, counting each bit of a multi-bit voter separately
     [[nodiscard]] size_t getSize() const {
         return size;
     }
 
 private:
+    //! One error signal to be OR'd together by @ref finalise
+    struct ErrorSource {
+        RTLIL::Wire *wire;
+        //! Number of cycles the signal lags behind the error it reports
+        size_t latency;
+    };
+
+    //! Registers one signal of the error tree, returning the output of the new FF
+    RTLIL::Wire *addErrorStage(RTLIL::Wire *signal);
+
     RTLIL::Module *module;
+    EditJournal *journal;
+    VoterStyle style;
+    size_t errorFanIn = 2;
+    size_t errorPipelineEvery = 0;
+    RTLIL::Wire *errorClock = nullptr;
     size_t size = 0;
-    std::vector<RTLIL::Wire *> reductions;
+    std::vector<ErrorSource> reductions;
 };
 
 }; // namespace tamara
@@ -0,0 +1,78 @@
+// TaMaRa: An automated triple modular redundancy EDA flow for Yosys.
+//
+// Copyright (c) 2025 Matt Young.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
+// was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#include "tamara/cell_ports.hpp"
+#include "kernel/log.h"
+#include "kernel/yosys_common.h"
+#include "tamara/util.hpp"
+#include <algorithm>
+
+USING_YOSYS_NAMESPACE;
+
+using namespace tamara;
+
+namespace {
+
+constexpr size_t MASK_BITS = 64;
+
+//! Sets the bit in the mask corresponding to the position of the port in the sorted list of ports
+void setBit(std::vector<uint64_t> &mask, const std::vector<int> &ports, int port) {
+    auto i = static_cast<size_t>(std::lower_bound(ports.begin(), ports.end(), port) - ports.begin());
+    mask.at(i / MASK_BITS) |= uint64_t { 1 } << (i % MASK_BITS);
+}
+
+} // namespace
+
+// usage of CellTypes is based off Yosys' show command
+CellPortOracle::CellPortOracle(RTLIL::Design *design)
+    : cellTypes(design) {
+    // TaMaRa's own voter cell isn't part of the internal cell library
+    cellTypes.setup_type(VOTER_CELL_TYPE, { ID::A, ID::B, ID::C }, { ID::Y, ID(ERR) });
+
+    for (const auto &[type, cellType] : cellTypes.cell_types) {
+        PortTable table;
+        for (const auto &port : cellType.inputs) {
+            table.ports.push_back(port.index_);
+        }
+        for (const auto &port : cellType.outputs) {
+            table.ports.push_back(port.index_);
+        }
+        // ports that are both inputs and outputs (inout) only get one entry
+        std::sort(table.ports.begin(), table.ports.end());
+        table.ports.erase(std::unique(table.ports.begin(), table.ports.end()), table.ports.end());
+
+        auto words = (table.ports.size() + MASK_BITS - 1) / MASK_BITS;
+        table.inputs.assign(words, 0);
+        table.outputs.assign(words, 0);
+        for (const auto &port : cellType.inputs) {
+            setBit(table.inputs, table.ports, port.index_);
+        }
+        for (const auto &port : cellType.outputs) {
+            setBit(table.outputs, table.ports, port.index_);
+        }
+
+        types.emplace(type.index_, std::move(table));
+    }
+
+    log_debug("Built port direction tables for %zu cell types\n", types.size());
+}
+
+bool CellPortOracle::test(const RTLIL::IdString &type, const RTLIL::IdString &port, bool output) const {
+    auto it = types.find(type.index_);
+    if (it == types.end()) {
+        return false;
+    }
+
+    const auto &table = it->second;
+    auto pos = std::lower_bound(table.ports.begin(), table.ports.end(), port.index_);
+    if (pos == table.ports.end() || *pos != port.index_) {
+        return false;
+    }
+
+    auto i = static_cast<size_t>(pos - table.ports.begin());
+    const auto &mask = output ? table.outputs : table.inputs;
+    return (mask.at(i / MASK_BITS) >> (i % MASK_BITS) & 1) != 0;
+}
@@ -0,0 +1,167 @@
+// TaMaRa: An automated triple modular redundancy EDA flow for Yosys.
+//
+// Copyright (c) 2025 Matt Young.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
+// was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#include "tamara/edit_journal.hpp"
+#include "kernel/log.h"
+#include "kernel/rtlil.h"
+#include "kernel/yosys_common.h"
+#include <algorithm>
+
+USING_YOSYS_NAMESPACE;
+
+using namespace tamara;
+
+std::optional<VerifyLevel> tamara::parseVerifyLevel(const std::string &level) {
+    if (level == "none") {
+        return VerifyLevel::None;
+    }
+    if (level == "end") {
+        return VerifyLevel::End;
+    }
+    if (level == "cone") {
+        return VerifyLevel::Cone;
+    }
+    if (level == "paranoid") {
+        return VerifyLevel::Paranoid;
+    }
+    return std::nullopt;
+}
+
+RTLIL::Wire *EditJournal::addWire(const RTLIL::IdString &name, int width) {
+    auto *wire = module->addWire(name, width);
+    wires.push_back(wire);
+    checkEdit();
+    return wire;
+}
+
+RTLIL::Wire *EditJournal::addWire(const RTLIL::IdString &name, const RTLIL::Wire *other) {
+    auto *wire = module->addWire(name, other);
+    wires.push_back(wire);
+    checkEdit();
+    return wire;
+}
+
+RTLIL::Cell *EditJournal::addCell(const RTLIL::IdString &name, const RTLIL::Cell *other) {
+    auto *cell = module->addCell(name, other);
+    add(cell);
+    checkEdit();
+    return cell;
+}
+
+RTLIL::Cell *EditJournal::recordCell(RTLIL::Cell *cell) {
+    log_assert(cell->module == module);
+    add(cell);
+    checkEdit();
+    return cell;
+}
+
+void EditJournal::setPort(RTLIL::Cell *cell, const RTLIL::IdString &port, const RTLIL::SigSpec &signal) {
+    // the index only needs to know what the port was connected to at the last commit, and new cells are
+    // indexed with whatever their ports end up connected to
+    if (index != nullptr && !added.contains(cell)) {
+        auto &ports = rewired[cell];
+        auto seen = [&](const auto &edit) { return edit.first == port; };
+        if (std::none_of(ports.begin(), ports.end(), seen)) {
+            ports.emplace_back(port, cell->hasPort(port) ? cell->getPort(port) : RTLIL::SigSpec());
+        }
+    }
+    cell->setPort(port, signal);
+    touch(cell);
+    checkEdit();
+}
+
+void EditJournal::connect(const RTLIL::SigSpec &lhs, const RTLIL::SigSpec &rhs) {
+    if (lhs.size() != rhs.size()) {
+        log_error("TaMaRa internal error: Tried to connect %s (%d bits) to %s (%d bits)\n", log_signal(lhs),
+            lhs.size(), log_signal(rhs), rhs.size());
+    }
+    connections.emplace_back(lhs, rhs);
+
+    if (level >= VerifyLevel::Paranoid) {
+        // the connection has to be in the module to be checked, but the index still catches up on commit
+        module->connect(lhs, rhs);
+        applied = connections.size();
+        checkEdit();
+    }
+}
+
+void EditJournal::commit() {
+    if (pending() == 0) {
+        return;
+    }
+    log_debug("Committing %zu cell(s), %zu wire(s) and %zu connection(s) to module %s\n", cells.size(),
+        wires.size(), connections.size(), log_id(module->name));
+
+    for (size_t i = applied; i < connections.size(); i++) {
+        module->connect(connections[i].first, connections[i].second);
+    }
+
+    // checking a cell only looks at its own ports, so this is proportional to the edits
+    if (level >= VerifyLevel::Cone) {
+        for (auto *cell : cells) {
+            cell->check();
+        }
+    }
+
+    // wires don't need indexing, their bits are indexed once something connects to them
+    if (index != nullptr) {
+        for (auto *cell : cells) {
+            if (added.contains(cell)) {
+                index->addCell(cell);
+            }
+        }
+        for (const auto &[cell, ports] : rewired) {
+            for (const auto &[port, previous] : ports) {
+                index->updatePort(cell, port, previous);
+            }
+        }
+        for (const auto &[lhs, rhs] : connections) {
+            index->updateConnection(lhs, rhs);
+        }
+    }
+
+    cells.clear();
+    touched.clear();
+    added.clear();
+    rewired.clear();
+    wires.clear();
+    connections.clear();
+    applied = 0;
+
+    verify(VerifyLevel::Paranoid);
+}
+
+void EditJournal::verify(VerifyLevel at) const {
+    if (level >= at) {
+        log_debug("Checking module %s\n", log_id(module->name));
+        module->check();
+    }
+}
+
+ConnectionIndex &EditJournal::getIndex() const {
+    if (index == nullptr) {
+        log_error("TaMaRa internal error: EditJournal for module %s has no connection index!\n",
+            log_id(module->name));
+    }
+    return *index;
+}
+
+void EditJournal::checkEdit() const {
+    if (level >= VerifyLevel::Paranoid) {
+        module->check();
+    }
+}
+
+void EditJournal::touch(RTLIL::Cell *cell) {
+    if (touched.insert(cell).second) {
+        cells.push_back(cell);
+    }
+}
+
+void EditJournal::add(RTLIL::Cell *cell) {
+    added.insert(cell);
+    touch(cell);
+}
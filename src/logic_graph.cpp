@@ -5,17 +5,20 @@
 // This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
 // was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #include "tamara/logic_graph.hpp"
-#include "kernel/celltypes.h"
 #include "kernel/log.h"
 #include "kernel/rtlil.h"
 #include "kernel/yosys_common.h"
+#include "tamara/edit_journal.hpp"
 #include "tamara/termcolour.hpp"
 #include "tamara/util.hpp"
 #include "tamara/voter_builder.hpp"
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cstring>
 #include <memory>
 #include <optional>
+#include <thread>
 #include <variant>
 #include <vector>
 
@@ -27,26 +30,75 @@ using namespace tamara;
 #define RESET() (termcolour::reset().c_str())
 
 uint32_t LogicCone::g_cone_ID = 0;
-ankerl::unordered_dense::set<std::string> LogicCone::g_explored_successors = {};
 
 namespace {
 
-//! Static message for when logRTLILName with an optional evaluates to none
-const char *const NONE_MESSAGE = "None";
+//! Marks a node that has not yet been claimed by any cone in LogicCone::partition
+constexpr uint32_t NO_CONE = UINT32_MAX;
 
-//! With the given map, either returns the existing value for the key "K", or the default value "def".
-template <class K, class V, class M>
-constexpr V getOrDefault(const M &map, const K &key, V def) {
-    if (map.contains(key)) {
-        return map.at(key);
+//! Returns true, and logs why, if the object was already replicated, by an earlier cone or an earlier run of
+//! the pass
+bool alreadyReplicated(const ObjectTags &tags, RTLIL::AttrObject *obj, const char *kind,
+    const RTLIL::IdString &name, uint32_t cone) {
+    if (!tags.isReplicated(obj)) {
+        return false;
     }
-    return def;
+    if (auto replicatedIn = tags.getCone(obj); replicatedIn.has_value()) {
+        log("When replicating %s %s in cone %u: Already replicated in logic cone %u\n", kind, log_id(name),
+            cone, replicatedIn.value());
+    } else {
+        log("When replicating %s %s in cone %u: Already replicated by an earlier run\n", kind, log_id(name),
+            cone);
+    }
+    return true;
+}
+
+//! An IO is simply a wire at the edge of the circuit, or an input of a hardened instance
+bool isWireIO(RTLIL::Wire *wire) {
+    return wire->port_input || wire->port_output || wire->has_attribute(INSTANCE_INPUT_ANNOTATION);
+}
+
+//! Returns true for every node that is an IO or FF, i.e. where the backwards BFS of a cone stops. Classifying
+//! up front means the concurrent part of LogicCone::partition never has to touch the NodePool.
+std::vector<bool> findTerminals(const NetlistGraph &graph) {
+    std::vector<bool> out(graph.size(), false);
+    for (NodeIndex i = 0; i < graph.size(); i++) {
+        out[i] = std::visit(
+            [](auto &&arg) {
+                using T = std::decay_t<decltype(arg)>;
+                if constexpr (std::is_same_v<T, RTLIL::Cell *>) {
+                    return isDFF(arg);
+                }
+                if constexpr (std::is_same_v<T, RTLIL::Wire *>) {
+                    return isWireIO(arg);
+                }
+            },
+            graph.node(i));
+    }
+    return out;
 }
 
-//! An IO is simply a wire at the edge of the circuit
-bool isWireIO(RTLIL::Wire *wire, const RTLILWireConnections &connections) {
-    return (connections.contains(wire) && connections.at(wire).empty()) || wire->port_input
-        || wire->port_output;
+//! Collects the unclaimed elements reachable backwards from the root without crossing a terminal, in BFS
+//! order. This only reads its arguments (and writes its own visited set), so it's safe to run concurrently.
+void reachFrom(const NetlistGraph &graph, const std::vector<bool> &terminals,
+    const std::vector<uint32_t> &owner, NodeIndex root, EpochSet &visited, std::vector<NodeIndex> &out) {
+    visited.clear();
+    out.clear();
+
+    auto consider = [&](NodeIndex neighbour) {
+        if (!terminals[neighbour] && owner[neighbour] == NO_CONE && visited.insert(neighbour)) {
+            out.push_back(neighbour);
+        }
+    };
+
+    for (auto neighbour : graph.neighbours(root)) {
+        consider(neighbour);
+    }
+    for (size_t head = 0; head < out.size(); head++) {
+        for (auto neighbour : graph.neighbours(out[head])) {
+            consider(neighbour);
+        }
+    }
 }
 
 //! Returns the RTLIL ID for a TMRGraphNode::Ptr
@@ -59,506 +111,592 @@ const char *logRTLILName(const TMRGraphNode::Ptr &ptr) {
     return log_id(getNodeName(ptr));
 }
 
-//! Override of getRTLILName that returns a char* through log_id. If the optional is not present, returns
-//! "None".
-const char *logRTLILName(const std::optional<TMRGraphNode::Ptr> &optional) {
-    if (!optional.has_value()) {
-        return NONE_MESSAGE;
-    }
-    return log_id(getNodeName(*optional));
-}
-
 //! Override for getRTLILName that returns a char* through log_id
 const char *logRTLILName(const RTLILAnyPtr &ptr) {
     return log_id(getRTLILName(ptr));
 }
 
-//! Instantiates a new logic cone from the RTLILAnyPtr.
-LogicCone newLogicCone(const RTLILAnyPtr &ptr) {
-    return std::visit(
-        [](auto &&arg) {
-            using T = std::decay_t<decltype(arg)>;
-            if constexpr (std::is_same_v<T, RTLIL::Cell *>) {
-                // make sure we have a DFF if it's an RTLIL::Cell
-                if (!isDFF(arg)) {
-                    log_error(
-                        "TaMaRa internal error: Tried to instantiate logic cone with a non-DFF RTLIL::Cell");
-                }
-                return LogicCone(arg);
-            }
-            if constexpr (std::is_same_v<T, RTLIL::Wire *>) {
-                return LogicCone(arg);
-            }
-        },
-        ptr);
-}
-
-//! Determines if neighbours should be added to a node during backwards BFS.
-//! Currently we only add neighbours if it's NOT a IONode or FFNode (which are considered terminals).
-bool shouldAddNeighbours(const TMRGraphNode::Ptr &node) {
-    return dynamic_pointer_cast<IONode>(node) == nullptr && dynamic_pointer_cast<FFNode>(node) == nullptr;
-}
+//! Returns the two copies of a wire of the original netlist, copying it the first time. The copies are
+//! internal to the replicas, so they aren't ports, and don't carry the annotations that mark the original.
+std::array<RTLIL::Wire *, 2> copyWire(
+    RTLIL::Wire *wire, uint32_t cone, EditJournal &journal, ReplicaMap &replicas) {
+    if (auto it = replicas.wires.find(wire); it != replicas.wires.end()) {
+        return it->second;
+    }
 
-//! Replicates the node if it's not an IONode. We can't replicate IONodes as they are inputs to the entire
-//! circuit.
-void replicateIfNotIO(const TMRGraphNode::Ptr &node, RTLIL::Module *module) {
-    if (dynamic_pointer_cast<IONode>(node) == nullptr) {
-        log("Input node %s is not IONode, replicating it\n", log_id(getNodeName(node)));
-        node->replicate(module);
-    } else {
-        log("Input node %s is IONode, it will NOT be replicated\n", log_id(getNodeName(node)));
+    auto &tags = journal.getTags();
+    std::array<RTLIL::Wire *, 2> copies {};
+    for (size_t i = 0; i < copies.size(); i++) {
+        auto *copy = journal.addWire(replicaId(wire->name, static_cast<int>(i) + 1, cone), wire);
+        copy->port_input = false;
+        copy->port_output = false;
+        copy->port_id = 0;
+        copy->attributes.erase(INSTANCE_INPUT_ANNOTATION);
+        copy->attributes.erase(ERROR_SINK_ANNOTATION);
+        tags.tagReplicated(copy, ObjectTags::Role::Replica, cone);
+        copies.at(i) = copy;
     }
+    tags.tagReplicated(wire, ObjectTags::Role::Original, cone);
+    replicas.wires.emplace(wire, copies);
+    return copies;
 }
 
-/// Taking an RTLILAnyPtr that came from a call to replicate(), returns the relevant output wire associated
-/// with it
-RTLIL::Wire *extractReplicaWire(const RTLILAnyPtr &ptr, const RTLILConnections &connections) {
-    log_debug("Extracting wire for replica '%s'\n", logRTLILName(ptr));
-    return std::visit(
-        [&](auto &&arg) {
-            using T = std::decay_t<decltype(arg)>;
-            if constexpr (std::is_same_v<T, RTLIL::Cell *>) {
-                DUMPASYNC;
-                RTLIL::Cell *cell = arg; // this is for the benefit of clangd
-                // log("Locating output wire for %s\n", log_id(cell->name));
-
-                CellTypes cellTypes(cell->module->design);
-
-                Wire *out = nullptr;
-
-                for (const auto &connection : cell->connections()) {
-                    const auto &[name, signal] = connection;
-
-                    // is this the output wire?
-                    if (cellTypes.cell_output(cell->type, name)) {
-                        if (out != nullptr) {
-                            log_error("TaMaRa internal error: Cell '%s' has multiple output ports - can't "
-                                      "yet handle this\n",
-                                log_id(cell->name));
-                        }
-                        // Now what we should do is make a new wire, which will be our output
-                        // then rip up the existing wire and redirect it
-                        // then return this wire
-                        // auto *wire = cell->module->addWire(
-                        //     tamaraId("extractReplicaWire_" + std::string(cell->name.c_str())),
-                        //     GetSize(signal));
-
-                        auto *wire = cell->module->addWire(tamaraId("eRW"), GetSize(signal));
-                        DUMPASYNC;
-
-                        auto connected = signalInverseLookup(connections.signals, signal);
-                        log("Before ripping up '%s', originally connected was:\n", log_id(cell->name));
-                        for (const auto &con : connected) {
-                            log("- %s\n", logRTLILName(con));
-                        }
-
-                        // rip up the existing wire, and add our own
-                        cell->setPort(name, wire);
-                        DUMPASYNC;
-                        log("Generated replacement wire '%s' for cell '%s'\n", log_id(wire->name),
-                            log_id(cell->name));
-
-                        out = wire;
-                    }
-                }
-
-                if (out == nullptr) {
-                    log_error("TaMaRa internal error: Failed to locate output wire for cell '%s'\n",
-                        log_id(cell->name));
-                }
-
-                DUMPASYNC;
-                return out;
-            }
-            if constexpr (std::is_same_v<T, RTLIL::Wire *>) {
-                // if it's just a wire, we can return that
-                return dynamic_cast<RTLIL::Wire *>(arg);
-            }
-        },
-        ptr);
+//! Rewrites the bits of the signal that have replicas into each replica, returns false if none of them do
+bool remapReplicas(const RTLIL::SigSpec &signal, const ReplicaMap &replicas, const SigMap &sigmap,
+    std::array<RTLIL::SigSpec, 2> &out) {
+    bool changed = false;
+    out = { signal, signal };
+    for (int i = 0; i < GetSize(signal); i++) {
+        const auto &bit = signal[i];
+        if (bit.wire == nullptr) {
+            continue;
+        }
+        auto it = replicas.bits.find(sigmap(bit));
+        if (it == replicas.bits.end()) {
+            continue;
+        }
+        out[0][i] = it->second[0];
+        out[1][i] = it->second[1];
+        changed = true;
+    }
+    return changed;
 }
 
 } // namespace
 
-TMRGraphNode::Ptr TMRGraphNode::newLogicGraphNeighbour(
-    const RTLILAnyPtr &ptr, const RTLILWireConnections &wireConnections) const {
+TMRGraphNode::Ptr NodePool::create(const RTLILAnyPtr &ptr, NodeIndex index, uint32_t coneID) {
+    // the control block and the node share one allocation in the arena, which is never freed individually
+    std::pmr::polymorphic_allocator<TMRGraphNode> allocator(&arena);
+
     // based on example 3 of https://en.cppreference.com/w/cpp/utility/variant/visit
-    auto localId = id;
     return std::visit(
-        [&, localId](auto &&arg) {
+        [&](auto &&arg) {
             using T = std::decay_t<decltype(arg)>;
             if constexpr (std::is_same_v<T, RTLIL::Cell *>) {
                 // my god this is ugly, we need to check if it's a DFF as well
                 if (isDFF(arg)) {
-                    return static_cast<TMRGraphNode::Ptr>(std::make_shared<FFNode>(arg, localId));
+                    return static_cast<TMRGraphNode::Ptr>(
+                        std::allocate_shared<FFNode>(allocator, arg, index, coneID));
                 }
-                return static_cast<TMRGraphNode::Ptr>(std::make_shared<ElementCellNode>(arg, localId));
+                return static_cast<TMRGraphNode::Ptr>(
+                    std::allocate_shared<ElementCellNode>(allocator, arg, index, coneID));
             }
             if constexpr (std::is_same_v<T, RTLIL::Wire *>) {
-                if (isWireIO(arg, wireConnections)) {
-                    // this is actually an IO
-                    return static_cast<TMRGraphNode::Ptr>(std::make_shared<IONode>(arg, localId));
-                }
-                // it's a wire, but just a regular element node -> not an IO
-                return static_cast<TMRGraphNode::Ptr>(std::make_shared<ElementWireNode>(arg, localId));
+                // the only wires in the graph are module ports and hardened instance inputs
+                return static_cast<TMRGraphNode::Ptr>(
+                    std::allocate_shared<IONode>(allocator, arg, index, coneID));
             }
         },
         ptr);
 }
 
-void ElementCellNode::replicate(RTLIL::Module *module) {
-    log("    Replicating %s %s\n", identify().c_str(), log_id(cell->name));
-    if (cell->has_attribute(CONE_ANNOTATION)) {
-        log("When replicating %s %s in cone %u: Already replicated in logic cone %s\n", identify().c_str(),
-            log_id(cell->name), getConeID(), cell->get_string_attribute(CONE_ANNOTATION).c_str());
-        return;
+TMRGraphNode::Ptr NodePool::get(NodeIndex index, uint32_t coneID) {
+    auto &node = nodes.at(index);
+    if (node == nullptr) {
+        node = create(graph.node(index), index, coneID);
     }
+    return node;
+}
 
-    auto id = std::to_string(getConeID());
-
-    auto *replica1 = module->addCell(RTLIL::IdString(cell->name.str() + "$replica1_cone" + id), cell);
-    auto *replica2 = module->addCell(RTLIL::IdString(cell->name.str() + "$replica2_cone" + id), cell);
-
-    replica1->set_string_attribute(CONE_ANNOTATION, id);
-    replica2->set_string_attribute(CONE_ANNOTATION, id);
-    cell->set_string_attribute(CONE_ANNOTATION, id);
-
-    cell->set_bool_attribute(ORIGINAL_ANNOTATION);
-
-    cell->check();
-    replica1->check();
-    replica2->check();
-    module->check();
-
-    replicas.push_back(replica1);
-    replicas.push_back(replica2);
-    DUMPASYNC;
+TMRGraphNode::Ptr NodePool::get(const RTLILAnyPtr &ptr, uint32_t coneID) {
+    auto index = graph.find(ptr);
+    if (index == INVALID_NODE) {
+        return create(ptr, INVALID_NODE, coneID);
+    }
+    return get(index, coneID);
 }
 
-void ElementWireNode::replicate(RTLIL::Module *module) {
-    log("    Replicating ElementWireNode %s\n", log_id(wire->name));
-    if (wire->has_attribute(CONE_ANNOTATION)) {
-        log("When replicating ElementWireNode %s in cone %u: Already replicated in logic cone %s\n",
-            log_id(wire->name), getConeID(), wire->get_string_attribute(CONE_ANNOTATION).c_str());
+void ElementCellNode::replicate(RTLIL::Module *module, EditJournal &journal) {
+    log("    Replicating %s %s\n", identify(), log_id(cell->name));
+    auto &tags = journal.getTags();
+    if (alreadyReplicated(tags, cell, identify(), cell->name, getConeID())) {
         return;
     }
 
-    auto id = std::to_string(getConeID());
-
-    auto *replica1 = module->addWire(RTLIL::IdString(wire->name.str() + "$replica1_cone" + id), wire);
-    auto *replica2 = module->addWire(RTLIL::IdString(wire->name.str() + "$replica2_cone" + id), wire);
-
-    replica1->set_string_attribute(CONE_ANNOTATION, id);
-    replica2->set_string_attribute(CONE_ANNOTATION, id);
-    wire->set_string_attribute(CONE_ANNOTATION, id);
+    auto *replica1 = journal.addCell(replicaId(cell->name, 1, getConeID()), cell);
+    auto *replica2 = journal.addCell(replicaId(cell->name, 2, getConeID()), cell);
 
-    wire->set_bool_attribute(ORIGINAL_ANNOTATION);
-
-    module->check();
+    tags.tagReplicated(replica1, ObjectTags::Role::Replica, getConeID());
+    tags.tagReplicated(replica2, ObjectTags::Role::Replica, getConeID());
+    tags.tagReplicated(cell, ObjectTags::Role::Original, getConeID());
 
     replicas.push_back(replica1);
     replicas.push_back(replica2);
-
-#ifdef TAMARA_DEBUG
-    if (getenv("TAMARA_DEBUG_AGGRESSIVE_CLEAN") != nullptr) {
-        Yosys::run_pass("opt_clean");
-    }
-#endif
-
     DUMPASYNC;
 }
 
-void IONode::replicate([[maybe_unused]] RTLIL::Module *module) {
-    // this shouldn't happen since we call replicateIfNotIO
+void IONode::replicate([[maybe_unused]] RTLIL::Module *module, [[maybe_unused]] EditJournal &journal) {
+    // this shouldn't happen since LogicCone::replicate never collects IOs
     log_error("TaMaRa internal error: Cannot replicate IO node!\n");
 }
 
-std::vector<TMRGraphNode::Ptr> TMRGraphNode::computeNeighbours(
-    const RTLILWireConnections &connections, const RTLILAnySignalConnections &signalConnections) {
-    auto obj = getRTLILObjPtr();
-    auto neighbours = getOrDefault(connections, obj, RTLILAnyPtrSet());
-    log("    %s '%s' has %zu neighbours\n", identify().c_str(), log_id(getRTLILName(obj)), neighbours.size());
-
-    // now, construct Yosys types into our logic graph types
-    std::vector<TMRGraphNode::Ptr> out {};
-    out.reserve(neighbours.size());
-    for (const auto &neighbour : neighbours) {
-        out.push_back(newLogicGraphNeighbour(neighbour, connections));
-    }
-    return out;
-}
-
 void LogicCone::verifyInputNodes() const {
     for (const auto &node : inputNodes) {
-        if (dynamic_pointer_cast<IONode>(node) == nullptr && dynamic_pointer_cast<FFNode>(node) == nullptr) {
+        if (!node->isTerminal()) {
             log_error("TaMaRa internal error: Logic cone input node should be either IONode or FFNode, but "
                       "instead it was %s %s!\n",
-                node->identify().c_str(), log_id(getNodeName(node)));
+                node->identify(), log_id(getNodeName(node)));
         }
     }
 }
 
-// NOLINTNEXTLINE(readability-function-cognitive-complexity) don't care, didn't ask
-void LogicCone::search(const RTLILConnections &connections) {
-    // check that we're starting the search from scratch on this cone
-    log_assert(frontier.empty());
-    log_assert(cone.empty());
-    log_assert(inputNodes.empty());
-
-    frontier.push(outputNode);
-
-    // keep track of the first node in the search, we always want to compute neighbours for this even if we
-    // normally wouldn't (because it's an FFNode/IONode)
-    bool first = true;
-
-    ankerl::unordered_dense::set<std::string> visited;
-
-    log("%sStarting search for cone %u%s\n", COLOUR(Blue), id, RESET());
-    while (!frontier.empty()) {
-        auto node = frontier.front();
-        frontier.pop();
-        log("    Consider %s '%s' in cone %u (%zu items remain)\n", node->identify().c_str(),
-            log_id(getNodeName(node)), id, frontier.size());
-
-        if (shouldAddNeighbours(node) || first) {
-            // locate neighbours and add to BFS queue
-            auto neighbours = node->computeNeighbours(connections.wires, connections.signals);
-            for (const auto &neighbour : neighbours) {
-                std::string name = getNodeName(neighbour).c_str();
-
-                if (!visited.contains(name)) {
-                    frontier.push(neighbour);
-                    visited.insert(name);
-                    log("    Push neighbour '%s'\n", logRTLILName(neighbour));
-                    // log("    Neighbour %s '%s' hash 0x%zX\n", neighbour->identify().c_str(),
-                    //     log_id(getNodeName(neighbour)), std::hash<TMRGraphNode::Ptr>()(neighbour));
-                }
-            }
+std::optional<VoterPolicy> tamara::parseVoterPolicy(const std::string &policy) {
+    if (policy == "ff") {
+        return VoterPolicy { .kind = VoterPolicy::Kind::FF };
+    }
+    if (policy == "outputs") {
+        return VoterPolicy { .kind = VoterPolicy::Kind::Outputs };
+    }
+    if (policy == "annotated") {
+        return VoterPolicy { .kind = VoterPolicy::Kind::Annotated };
+    }
 
-            // since this is not a terminal node, we can go ahead and add it to the cone. remember, we don't
-            // want to add terminals to the cone on either its input or output.
-            //
-            // add to logic cone if not IO, this is because we don't want to replicate IOs, but we do
-            // replicate Elements and FFs. we can't replicate IOs because they're outputs/inputs of course.
-            // also don't add the first element to the cone, as it'll cause duplicates elsewhere.
-            if (dynamic_pointer_cast<IONode>(node) == nullptr && !first) {
-                cone.push_back(node);
-                log("    %sAdd %s to cone (now has %zu items)%s\n", COLOUR(Green), node->identify().c_str(),
-                    cone.size(), RESET());
-            } else {
-                log("    %sSkip adding %s to cone (first: %s)%s\n", COLOUR(Red), node->identify().c_str(),
-                    first ? "true" : "false", RESET());
-            }
-        } else {
-            // found terminal, start wrapping up search -> don't add neighbours, and don't add elements to
-            // cone
-            log("    %s%s %s is a terminal, wrapping up search%s\n", COLOUR(Yellow), node->identify().c_str(),
-                log_id(getNodeName(node)), RESET());
+    const std::string every = "every:";
+    if (policy.starts_with(every)) {
+        auto interval = atoi(policy.substr(every.size()).c_str());
+        if (interval < 1) {
+            return std::nullopt;
         }
+        return VoterPolicy { .kind = VoterPolicy::Kind::Every, .interval = static_cast<uint32_t>(interval) };
+    }
+    return std::nullopt;
+}
 
-        // select voter cut point: the first node that we find on the backwards BFS (not the initial node)
-        if (!voterCutPoint.has_value() && !first) {
-            // we don't really support setting ElementWireNodes or IONode as voters
-            // see https://github.com/mattyoung101/tamara/issues/22#issuecomment-2711490999
-            if (dynamic_pointer_cast<ElementWireNode>(node) != nullptr
-                || dynamic_pointer_cast<IONode>(node) != nullptr) {
-                log("    Would have set this node as cut point, but it's a wire or IO. Skipping.\n");
-            } else {
-                voterCutPoint = node;
-                log("    %sSet voter cut point to this node%s\n", COLOUR(Cyan), RESET());
-            }
+void LogicCone::applyVoterPolicy(std::vector<LogicCone> &cones, const VoterPolicy &policy) {
+    size_t voted = 0;
+    for (auto &cone : cones) {
+        // depth 0 is an output, which always has to be voted
+        switch (policy.kind) {
+        case VoterPolicy::Kind::FF:
+            cone.voted = true;
+            break;
+        case VoterPolicy::Kind::Every:
+            cone.voted = cone.depth % policy.interval == 0;
+            break;
+        case VoterPolicy::Kind::Outputs:
+            cone.voted = cone.depth == 0;
+            break;
+        case VoterPolicy::Kind::Annotated:
+            cone.voted = cone.depth == 0 || cone.hasVoteAnnotation();
+            break;
         }
 
-        if (!frontier.empty()) {
-            // search would continue
-            log("\n");
+        if (cone.voted) {
+            voted++;
         } else {
-            // we're terminating search
-            log("    %sPush node '%s' to input nodes%s\n", COLOUR(Yellow), logRTLILName(node), RESET());
-            // if it's an IONode or FFNode, we can push it as a neighbour
-            if (dynamic_pointer_cast<IONode>(node) != nullptr
-                || dynamic_pointer_cast<FFNode>(node) != nullptr) {
-                inputNodes.push_back(node);
-            }
+            log_debug("Voter policy leaves cone %u (depth %u) without a voter\n", cone.id, cone.depth);
         }
-
-        first = false;
     }
-
-    verifyInputNodes();
-    log("%sSearch complete for cone %u, have %zu items\n%s", COLOUR(Blue), id, cone.size(), RESET());
+    log("Voter policy places voters in %zu of %zu logic cones\n", voted, cones.size());
 }
 
-void LogicCone::replicate(RTLIL::Module *module) {
-    // don't replicate cones that don't have any internal elements (prevents duplication)
-    if (cone.empty()) {
-        log("%sCone %u has no internal elements - skipping replication%s\n", COLOUR(Red), id, RESET());
-        return;
+bool LogicCone::hasVoteAnnotation() const {
+    const auto &root = outputNode->getRTLILObjPtr();
+    if (!std::holds_alternative<RTLIL::Cell *>(root)) {
+        return false;
     }
-    log_assert(frontier.empty() && "Search might not be finished");
 
-    DUMPASYNC;
-    log("%sReplicating %zu collected items for logic cone %u%s\n", COLOUR(Blue), cone.size(), id, RESET());
-    for (const auto &item : cone) {
-        item->replicate(module);
+    // Yosys keeps attributes on a reg on the wire, rather than the FF that drives it
+    auto *ff = std::get<RTLIL::Cell *>(root);
+    if (ff->has_attribute(VOTE_ANNOTATION)) {
+        return true;
     }
-
-    // special case for end points (IOs and FFs) -> only replicate FFs, don't replicate IOs
-    log("%sChecking terminals%s\n", COLOUR(Cyan), RESET());
-    for (const auto &node : inputNodes) {
-        replicateIfNotIO(node, module);
+    if (ff->hasPort(ID::Q)) {
+        for (const auto &chunk : ff->getPort(ID::Q).chunks()) {
+            if (chunk.wire != nullptr && chunk.wire->has_attribute(VOTE_ANNOTATION)) {
+                return true;
+            }
+        }
     }
-    replicateIfNotIO(outputNode, module);
-
-    DUMPASYNC;
+    return false;
 }
 
-std::optional<RTLIL::Wire *> LogicCone::insertVoter(
-    VoterBuilder &builder, const std::vector<RTLILAnyPtr> &replicas, const RTLILConnections &connections) {
-    log("%sInserting voter into logic cone %u%s\n", COLOUR(Blue), id, RESET());
-    if (cone.empty()) {
-        log("%sSkipping voter insertion into cone %u - internal elements empty%s\n", COLOUR(Red), id,
-            RESET());
-        return std::nullopt;
+// NOLINTNEXTLINE(readability-function-cognitive-complexity) don't care, didn't ask
+std::vector<LogicCone> LogicCone::partition(const std::vector<RTLIL::Wire *> &outputs,
+    const RTLILConnections &connections, NodePool &pool, size_t threads) {
+    const auto &graph = connections.graph;
+    auto terminals = findTerminals(graph);
+
+    std::vector<LogicCone> cones;
+    cones.reserve(outputs.size());
+    for (auto *output : outputs) {
+        cones.emplace_back(output, pool);
     }
 
-    log("Going to splice voter between LogicCone output %s and cut point %s\n", logRTLILName(outputNode),
-        logRTLILName(voterCutPoint));
-    DUMPASYNC;
+    // the cone that owns each element, indexed by NodeIndex. terminals are never owned, as they're shared by
+    // the cone they are the output of, and every cone they are an input of.
+    std::vector<uint32_t> owner(graph.size(), NO_CONE);
+    // FFs that are already the root of a cone
+    std::vector<bool> isRoot(graph.size(), false);
+    for (const auto &cone : cones) {
+        auto root = cone.outputNode->getIndex();
+        if (root != INVALID_NODE) {
+            isRoot[root] = true;
+        }
+    }
+
+    // terminals and wires visited by the cone being merged. clearing it only starts a new epoch, so this is
+    // free
+    EpochSet visited;
+    visited.reserve(graph.size());
+    // FFs found by the cone being merged that will become roots, appended once it's done
+    std::vector<RTLIL::Cell *> newRoots;
+
+    // merges the elements reached by a cone into it, in root order. an element reached by several cones in
+    // the same wave is claimed by the first one merged. every edge out of an element is only walked by the
+    // cone that claimed it, and terminals end the walk, so the merges are linear in the size of the graph.
+    auto merge = [&](size_t coneIdx, const std::vector<NodeIndex> &reach) {
+        auto &cone = cones[coneIdx];
+        auto root = cone.outputNode->getIndex();
+        if (root == INVALID_NODE) {
+            log_debug("Cone %u output '%s' is not connected to anything\n", cone.id,
+                logRTLILName(cone.outputNode));
+            return;
+        }
 
-    // log("out_w voterCutPoint\n");
-    // NOTE: It is VERY important that out_w runs first, otherwise the wires are not connected correctly (c
-    // gets overwritten basically)
-    auto *out_w = extractReplicaWire(voterCutPoint->get()->getRTLILObjPtr(), connections);
+        // walk the neighbours of the root and then each claimed element, in BFS order. this is where nodes
+        // are fetched from the pool, so each one is created with the ID of the first cone to reach it.
+        // the root is deliberately not marked as visited, so that cones with feedback find it again as an
+        // input terminal.
+        visited.clear();
+        auto walk = [&](NodeIndex from) {
+            for (auto neighbour : graph.neighbours(from)) {
+                auto node = pool.get(neighbour, cone.id);
+                if (!terminals[neighbour] || !visited.insert(neighbour)) {
+                    continue;
+                }
+                cone.inputNodes.push_back(node);
+
+                // an FF which is driven by something becomes the root of its own cone
+                if (node->getKind() == NodeKind::FF && !isRoot[neighbour]
+                    && !graph.neighbours(neighbour).empty()) {
+                    isRoot[neighbour] = true;
+                    newRoots.push_back(std::get<RTLIL::Cell *>(node->getRTLILObjPtr()));
+                }
+            }
+        };
+
+        walk(root);
+        for (auto element : reach) {
+            // elements shared with an earlier cone in this wave have already been claimed (and will be
+            // replicated) by it
+            if (owner[element] != NO_CONE) {
+                continue;
+            }
+            owner[element] = coneIdx;
+            auto node = pool.get(element, cone.id);
+            cone.cone.push_back(node);
+            log_debug("    Add %s '%s' to cone %u\n", node->identify(), logRTLILName(node), cone.id);
+            walk(element);
+        }
 
-    auto *a_w = extractReplicaWire(replicas.at(0), connections);
-    auto *b_w = extractReplicaWire(replicas.at(1), connections);
-    auto *c_w = extractReplicaWire(replicas.at(2), connections);
+        cone.verifyInputNodes();
+        log("%sCone %u from %s has %zu items, %zu inputs%s\n", COLOUR(Blue), cone.id,
+            logRTLILName(cone.outputNode), cone.cone.size(), cone.inputNodes.size(), RESET());
 
-    log("Voter info dump:\n  voterCutPoint: %s\n  replicas[0]: %s\n  replicas[1]: %s\n  replicas[2]: %s\n",
-        logRTLILName(voterCutPoint->get()->getRTLILObjPtr()), logRTLILName(replicas.at(0)),
-        logRTLILName(replicas.at(1)), logRTLILName(replicas.at(2)));
+        // this may reallocate the vector, so the cone can't be used after here
+        auto depth = cone.depth + 1;
+        for (auto *ff : newRoots) {
+            cones.emplace_back(ff, pool);
+            cones.back().depth = depth;
+        }
+        newRoots.clear();
+    };
 
-    if (a_w == b_w || a_w == c_w || b_w == c_w || a_w == out_w || b_w == out_w || c_w == out_w) {
-        log("%sWIRING FAULT DETECTED%s\n", COLOUR(Red), RESET());
-        log_warning("TaMaRa internal warning: One of a_w, b_w, c_w and/or out_w are NOT unique. This will "
-                    "probably cause a wiring problem.\n");
+    // one visited set and reach per worker thread, reused across waves
+    std::vector<EpochSet> workerVisited(std::max<size_t>(1, threads));
+    for (auto &set : workerVisited) {
+        set.reserve(graph.size());
     }
+    std::vector<std::vector<NodeIndex>> reaches;
+
+    // cones are appended to as FF roots are discovered, so each wave ends where the previous one's merges
+    // stopped
+    size_t waveBegin = 0;
+    while (waveBegin < cones.size()) {
+        size_t waveEnd = cones.size();
+        auto rootOf = [&](size_t coneIdx) { return cones[coneIdx].outputNode->getIndex(); };
+
+        if (threads <= 1) {
+            // searching and merging each cone in turn means that every search already skips the elements of
+            // all previous cones, so nothing is searched twice
+            reaches.resize(1);
+            for (size_t coneIdx = waveBegin; coneIdx < waveEnd; coneIdx++) {
+                reaches[0].clear();
+                if (rootOf(coneIdx) != INVALID_NODE) {
+                    reachFrom(graph, terminals, owner, rootOf(coneIdx), workerVisited[0], reaches[0]);
+                }
+                merge(coneIdx, reaches[0]);
+            }
+        } else {
+            // search the whole wave concurrently. the cones only read the graph and the owners from previous
+            // waves, which don't change until the merge below, and each writes only its own reach.
+            // cones are handed out one at a time, as their sizes vary wildly.
+            auto waveSize = waveEnd - waveBegin;
+            reaches.resize(std::max(reaches.size(), waveSize));
+            std::atomic<size_t> next = waveBegin;
+            auto worker = [&](size_t workerIdx) {
+                for (auto coneIdx = next++; coneIdx < waveEnd; coneIdx = next++) {
+                    auto &reach = reaches[coneIdx - waveBegin];
+                    reach.clear();
+                    if (rootOf(coneIdx) != INVALID_NODE) {
+                        reachFrom(graph, terminals, owner, rootOf(coneIdx), workerVisited[workerIdx], reach);
+                    }
+                }
+            };
 
-    builder.build(a_w, b_w, c_w, out_w);
-    DUMPASYNC;
+            auto workers = std::min(threads, waveSize);
+            std::vector<std::thread> workerThreads {};
+            workerThreads.reserve(workers - 1);
+            for (size_t workerIdx = 1; workerIdx < workers; workerIdx++) {
+                workerThreads.emplace_back(worker, workerIdx);
+            }
+            worker(0);
+            for (auto &thread : workerThreads) {
+                thread.join();
+            }
+
+            // merge serially in root order, this is the only part that touches the pool or logs
+            for (size_t coneIdx = waveBegin; coneIdx < waveEnd; coneIdx++) {
+                merge(coneIdx, reaches[coneIdx - waveBegin]);
+            }
+        }
 
-    return out_w;
+        waveBegin = waveEnd;
+    }
+
+    return cones;
 }
 
-void LogicCone::wire(RTLIL::Module *module, const RTLILConnections &connections, VoterBuilder &builder) {
-    log("%sWiring logic cone %u%s\n", COLOUR(Blue), id, RESET());
-    if (cone.empty()) {
-        log("%sSkipping wiring of cone %u - internal elements empty%s\n", COLOUR(Red), id, RESET());
+
+void LogicCone::replicate(const RTLILConnections &connections, EditJournal &journal, ReplicaMap &replicas) {
+    auto &tags = journal.getTags();
+
+    // the root and the FFs this cone reads are shared with other cones, so they're replicated by whichever
+    // cone gets to them first. IOs are never replicated, as they are inputs to the entire circuit.
+    std::vector<TMRGraphNode::Ptr> nodes;
+    auto collect = [&](const TMRGraphNode::Ptr &node) {
+        if (node->getKind() == NodeKind::IO) {
+            return;
+        }
+        auto *cell = std::get<RTLIL::Cell *>(node->getRTLILObjPtr());
+        if (!alreadyReplicated(tags, cell, node->identify(), cell->name, id)) {
+            nodes.push_back(node);
+        }
+    };
+
+    collect(outputNode);
+    for (const auto &node : cone) {
+        collect(node);
+    }
+    for (const auto &node : inputNodes) {
+        if (node != outputNode) {
+            collect(node);
+        }
+    }
+
+    if (nodes.empty()) {
+        log("%sCone %u has nothing left to replicate%s\n", COLOUR(Red), id, RESET());
         return;
     }
-    if (!voterCutPoint.has_value()) {
-        log_error("TaMaRa internal error: Voter cut point not set!\n");
+
+    DUMPASYNC;
+    log("%sReplicating %zu collected items for logic cone %u%s\n", COLOUR(Blue), nodes.size(), id, RESET());
+    cloneElements(nodes, connections, journal, replicas);
+
+#ifdef TAMARA_DEBUG
+    if (getenv("TAMARA_DEBUG_AGGRESSIVE_CLEAN") != nullptr) {
+        Yosys::run_pass("opt_clean");
     }
+#endif
+
     DUMPASYNC;
+}
 
-    // connect voter between output and firstReplicated
-    log("Voter cut point: %s\n", logRTLILName(voterCutPoint.value()));
-    auto replicas = voterCutPoint->get()->getReplicas();
-    log_assert(replicas.size() == 2 && "Expected 2 replicas");
-
-    // we also add the original node to the list of replicas, so that we can connect it up to the voter
-    // since we already have one original node, + 2 replicas, this is a total of 3 :)
-    // this is a little bit confusing for the terminology since it's not _technically_ a replica
-    replicas.push_back(voterCutPoint->get()->getRTLILObjPtr());
-
-    // handle voter insertion
-    auto voterOutWire = insertVoter(builder, replicas, connections);
-
-    // connected output wire
-    if (voterOutWire.has_value()) {
-        log("Connecting cone output '%s' to voter output '%s'\n", logRTLILName(outputNode),
-            log_id(voterOutWire.value()->name));
-
-        DUMPASYNC;
-
-        // this is the extracted output wire for the cone
-        auto *outNodeWire = extractReplicaWire(outputNode->getRTLILObjPtr(), connections);
-        DUMPASYNC;
-
-        // locate SigSpecs associated with the output node wire
-        RTLILSigSpecSet attachedSigSpecs = getOrDefault(connections.signals, outNodeWire, RTLILSigSpecSet());
-
-        // check if we have multiple attached SigChunk (see https://github.com/mattyoung101/tamara/issues/13)
-        // in that case, special wiring will be required
-        if (attachedSigSpecs.size() > 1) {
-            log("Special wiring required (outNodeWire '%s' has %zu attached SigSpecs)\n",
-                log_signal(outNodeWire), attachedSigSpecs.size());
-
-            // lookup the SigSpecs that are the _output_ of the voter cut point, on the _original_ circuit
-            auto *voterCutCell = std::get<RTLIL::Cell *>(voterCutPoint.value()->getRTLILObjPtr());
-            // the important part here is that this routine runs on the original circuit before we modify it,
-            // hence why we're looking up into connections.cellOutputs (which is calculated by
-            // utils.cpp#analyseAll before we mess with it)
-            auto voterSpecs = connections.cellOutputs.at(voterCutCell);
-            log("voterSpecs:\n");
-            for (const auto &spec : voterSpecs) {
-                log("%s\n", log_signal(spec));
+void LogicCone::cloneElements(const std::vector<TMRGraphNode::Ptr> &nodes,
+    const RTLILConnections &connections, EditJournal &journal, ReplicaMap &replicas) {
+    const auto &sigmap = connections.sigmap;
+    const auto &ports = journal.getIndex().getPorts();
+    auto wires = replicas.wires.size();
+
+    // decide what the copies of every cell drive before copying any of them, so that every bit driven in
+    // this cone is known when the inputs are remapped. this is done a bit at a time, so it doesn't matter
+    // how the outputs of the cells are sliced up between wires, or how many cells drive one wire
+    for (const auto &node : nodes) {
+        auto *cell = std::get<RTLIL::Cell *>(node->getRTLILObjPtr());
+        for (const auto &[name, signal] : cell->connections()) {
+            if (!ports.isOutput(cell->type, name)) {
+                continue;
+            }
+            for (int i = 0; i < GetSize(signal); i++) {
+                const auto &bit = signal[i];
+                if (bit.wire == nullptr) {
+                    continue;
+                }
+                auto copies = copyWire(bit.wire, id, journal, replicas);
+                replicas.bits[sigmap(bit)]
+                    = { RTLIL::SigBit(copies[0], bit.offset), RTLIL::SigBit(copies[1], bit.offset) };
             }
+        }
+    }
 
-            // hopefully that set only has one element in it, if it doesn't, we don't yet know how to deal
-            // with that (perhaps this indicates a multi-port output cell?)
-            if (voterSpecs.size() > 1) {
-                log_error("TaMaRa internal error: voterSpecs has size %zu, which we "
-                          "can't yet deal with!\n",
-                    voterSpecs.size());
+    // then copy each cell, and rewire both the inputs and the outputs of its copies in the same step
+    size_t rewired = 0;
+    std::array<RTLIL::SigSpec, 2> remapped;
+    for (const auto &node : nodes) {
+        auto *cell = std::get<RTLIL::Cell *>(node->getRTLILObjPtr());
+        node->replicate(journal.getModule(), journal);
+        auto copies = node->getReplicas();
+        log_assert(copies.size() == 2 && "Expected 2 replicas");
+
+        for (const auto &[name, signal] : cell->connections()) {
+            if (!remapReplicas(signal, replicas, sigmap, remapped)) {
+                continue;
             }
+            for (size_t i = 0; i < copies.size(); i++) {
+                journal.setPort(std::get<RTLIL::Cell *>(copies.at(i)), name, remapped.at(i));
+            }
+            rewired++;
+        }
+    }
 
-            auto first = *voterSpecs.begin();
-            module->connect(first, voterOutWire.value());
-            log("Connecting attached SigSpec to %s\n", log_signal(first));
+    log("Copied %zu cells and %zu wires of cone %u, rewiring %zu ports of the copies\n", nodes.size(),
+        replicas.wires.size() - wires, id, rewired);
+}
 
-            DUMPASYNC;
-        } else {
-            log("Using regular wiring (only one attached SigChunk)\n");
-            module->connect(outNodeWire, voterOutWire.value());
+std::vector<RTLIL::SigBit> LogicCone::findVoteBits(
+    const RTLILConnections &connections, const ReplicaMap &replicas) const {
+    // an IO root reads the whole wire, and an FF root reads every port except its output
+    RTLIL::SigSpec read;
+    auto root = outputNode->getRTLILObjPtr();
+    if (std::holds_alternative<RTLIL::Wire *>(root)) {
+        read = std::get<RTLIL::Wire *>(root);
+    } else {
+        for (const auto &[name, signal] : std::get<RTLIL::Cell *>(root)->connections()) {
+            if (name != ID::Q) {
+                read.append(signal);
+            }
+        }
+    }
 
-            DUMPASYNC;
+    std::vector<RTLIL::SigBit> out;
+    ankerl::unordered_dense::set<RTLIL::SigBit> seen;
+    for (int i = 0; i < GetSize(read); i++) {
+        auto bit = connections.sigmap(read[i]);
+        if (bit.wire != nullptr && replicas.bits.contains(bit) && seen.insert(bit).second) {
+            out.push_back(bit);
         }
-    } else {
-        log("No voter inserted (cone probably empty), skipping output connection\n");
     }
-    module->check();
+    return out;
+}
 
-    // now, clean up by running the FixWalkers
-    log("\n%sFixing up wiring%s\n", COLOUR(Blue), RESET());
-    fixWalkers.execute(module);
+void LogicCone::insertVoter(const std::vector<RTLIL::SigBit> &bits, VoterBuilder &builder,
+    EditJournal &journal, ReplicaMap &replicas) {
+    auto width = GetSize(bits);
+    log("%sInserting %d bit voter into logic cone %u%s\n", COLOUR(Blue), width, id, RESET());
+
+    // the drivers are looked up in the live index, so it has to catch up with the replication first
+    journal.commit();
+    const auto &index = journal.getIndex();
+
+    // move the driver of each original bit onto the first input of the voter. each port is only rewritten
+    // once, after all of its bits have been moved
+    auto *a = journal.addWire(tamaraId("voter_a"), width);
+    ankerl::unordered_dense::map<RTLIL::Cell *, std::vector<std::pair<RTLIL::IdString, RTLIL::SigSpec>>>
+        ripped;
+    for (int i = 0; i < width; i++) {
+        const auto *connections = index.find(bits.at(i));
+        if (connections == nullptr || connections->drivers.size() != 1
+            || !std::holds_alternative<RTLIL::Cell *>(connections->drivers.front().owner)) {
+            log_error(
+                "TaMaRa internal error: Replicated bit %s in cone %u is not driven by exactly one cell!\n",
+                log_signal(bits.at(i)), id);
+        }
+        const auto &driver = connections->drivers.front();
+        auto *cell = std::get<RTLIL::Cell *>(driver.owner);
+
+        auto &cellPorts = ripped[cell];
+        auto it = std::find_if(cellPorts.begin(), cellPorts.end(),
+            [&](const auto &port) { return port.first == driver.port; });
+        if (it == cellPorts.end()) {
+            it = cellPorts.emplace(cellPorts.end(), driver.port, cell->getPort(driver.port));
+        }
+        it->second[driver.offset] = RTLIL::SigBit(a, i);
+    }
+    for (const auto &[cell, cellPorts] : ripped) {
+        for (const auto &[port, signal] : cellPorts) {
+            journal.setPort(cell, port, signal);
+        }
+    }
+
+    // the other two inputs are the replicas, and the output drives the original bits in place of their old
+    // driver. the bits are voted now, so anything that reads them from here on reads the voter output
+    RTLIL::SigSpec original;
+    std::array<RTLIL::SigSpec, 2> replicaBits;
+    for (const auto &bit : bits) {
+        auto copies = replicas.bits.at(bit);
+        original.append(bit);
+        replicaBits[0].append(copies[0]);
+        replicaBits[1].append(copies[1]);
+        replicas.bits.erase(bit);
+    }
 
+    auto *b = journal.addWire(tamaraId("voter_b"), width);
+    auto *c = journal.addWire(tamaraId("voter_c"), width);
+    auto *out = journal.addWire(tamaraId("voter_out"), width);
+    journal.connect(b, replicaBits[0]);
+    journal.connect(c, replicaBits[1]);
+    journal.connect(original, out);
+
+    builder.build(a, b, c, out);
     DUMPASYNC;
 }
 
-std::vector<LogicCone> LogicCone::buildSuccessors(const RTLILConnections &connections) {
-    log("%sConsidering potential successors for cone %u%s\n", COLOUR(Blue), id, RESET());
-    std::vector<LogicCone> out {};
-    // reserve worst-case size, minor performance improvement?
-    out.reserve(inputNodes.size());
+void LogicCone::wire(RTLIL::Module *module, const RTLILConnections &connections, EditJournal &journal,
+    VoterBuilder &builder, ReplicaMap &replicas) {
+    log("%sWiring logic cone %u%s\n", COLOUR(Blue), id, RESET());
 
-    for (const auto &node : inputNodes) {
-        std::string name = getNodeName(node).c_str();
-        log("Considering %s %s as a successor cone... ", node->identify().c_str(), name.c_str());
-
-        // check if it has a neighbour that we haven't already made a cone out of yet
-        if (connections.wires.contains(node->getRTLILObjPtr())
-            && connections.wires.at(node->getRTLILObjPtr()).size() > 0
-            && !g_explored_successors.contains(name)) {
-            // we have neighbours, this is a valid successor
-            log("%sConfirmed.%s\n", COLOUR(Green), RESET());
-            out.push_back(newLogicCone(node->getRTLILObjPtr()));
-            g_explored_successors.insert(name);
-        } else {
-            log("%sHas no additional neighbours, not a valid successor.%s\n", COLOUR(Red), RESET());
+    // bits voted by an earlier cone have already left the replica map, so they aren't voted twice
+    auto bits = findVoteBits(connections, replicas);
+    if (bits.empty()) {
+        log("Root %s of cone %u reads no replicated bits that still need a voter\n", logRTLILName(outputNode),
+            id);
+    } else if (voted) {
+        insertVoter(bits, builder, journal, replicas);
+    } else {
+        log("%sVoter policy leaves cone %u without a voter%s\n", COLOUR(Yellow), id, RESET());
+    }
+
+    // the copies of an FF root were made by the cone that found it as an input, before the logic driving it
+    // was replicated. now each copy reads its own replica, or the voter output if its inputs were voted.
+    std::vector<RTLILAnyPtr> copies;
+    if (outputNode->getKind() == NodeKind::FF) {
+        copies = outputNode->getReplicas();
+    }
+    if (copies.size() == 2) {
+        auto *ff = std::get<RTLIL::Cell *>(outputNode->getRTLILObjPtr());
+        std::array<RTLIL::SigSpec, 2> remapped;
+        for (const auto &[name, signal] : ff->connections()) {
+            if (name == ID::Q) {
+                continue;
+            }
+            remapReplicas(signal, replicas, connections.sigmap, remapped);
+            for (size_t i = 0; i < copies.size(); i++) {
+                auto *copy = std::get<RTLIL::Cell *>(copies.at(i));
+                if (copy->getPort(name) != remapped.at(i)) {
+                    journal.setPort(copy, name, remapped.at(i));
+                }
+            }
         }
     }
 
-    return out;
+    // the FixWalkers look at the connection index, so it has to catch up with this cone's edits first
+    journal.commit();
+
+    // now, clean up by running the FixWalkers
+    log("\n%sFixing up wiring%s\n", COLOUR(Blue), RESET());
+    fixWalkers.execute(module, journal);
+    journal.verify(VerifyLevel::Cone);
+
+    DUMPASYNC;
 }
@@ -0,0 +1,190 @@
+// TaMaRa: An automated triple modular redundancy EDA flow for Yosys.
+//
+// Copyright (c) 2025 Matt Young.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
+// was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#include "tamara/memory_scrubber.hpp"
+#include "kernel/log.h"
+#include "kernel/mem.h"
+#include "kernel/rtlil.h"
+#include "kernel/yosys_common.h"
+#include "tamara/edit_journal.hpp"
+#include "tamara/util.hpp"
+#include "tamara/voter_builder.hpp"
+#include <algorithm>
+#include <array>
+#include <vector>
+
+USING_YOSYS_NAMESPACE;
+
+using namespace tamara;
+
+namespace {
+
+//! Adds a triplicated register, clocked by the scrubber clock and initialised to `init`. Returns the voted
+//! output of its three FFs, and sets `in` to the D wire they share, which the caller drives. The scrubber
+//! writes to all three copies of the memory at once, so an upset in one of its FFs must not be able to
+//! change what it writes, or where.
+RTLIL::Wire *addRegister(EditJournal &journal, VoterBuilder &builder, const MemWr &clock,
+    const std::string &name, const RTLIL::Const &init, RTLIL::Wire *&in) {
+    auto *module = journal.getModule();
+    auto width = GetSize(init);
+    in = journal.addWire(tamaraId(name + "_d"), width);
+    std::array<RTLIL::Wire *, 3> q {};
+    for (auto &replica : q) {
+        replica = journal.addWire(tamaraId(name + "_q"), width);
+        replica->attributes[ID::init] = init;
+        journal.recordCell(module->addDff(tamaraId(name), clock.clk, in, replica, clock.clk_polarity));
+    }
+    auto *voted = journal.addWire(tamaraId(name + "_voted"), width);
+    builder.build(q.at(0), q.at(1), q.at(2), voted);
+    return voted;
+}
+
+} // namespace
+
+std::optional<ScrubPolicy::Arbitration> tamara::parseScrubArbitration(const std::string &arbitration) {
+    if (arbitration == "idle") {
+        return ScrubPolicy::Arbitration::Idle;
+    }
+    if (arbitration == "always") {
+        return ScrubPolicy::Arbitration::Always;
+    }
+    return std::nullopt;
+}
+
+bool tamara::addScrubber(EditJournal &journal, VoterBuilder &builder, Mem &mem, const ScrubPolicy &policy) {
+    log_assert(policy.rate != 0 && "Scrubber needs a rate");
+    auto *module = journal.getModule();
+
+    // the scrubber has to write in the same clock domain as the design, so that its writes can be ordered
+    // against the design's writes
+    if (mem.wr_ports.empty()) {
+        log_warning("Memory '%s' has no write ports, so it can't be scrubbed\n", log_id(mem.memid));
+        return false;
+    }
+    const auto clock = mem.wr_ports.front();
+    for (const auto &port : mem.wr_ports) {
+        if (!port.clk_enable) {
+            log_warning("Memory '%s' has an asynchronous write port, so it can't be scrubbed\n",
+                log_id(mem.memid));
+            return false;
+        }
+        if (port.clk != clock.clk || port.clk_polarity != clock.clk_polarity) {
+            log_warning(
+                "Memory '%s' has write ports in more than one clock domain, so it can't be scrubbed\n",
+                log_id(mem.memid));
+            return false;
+        }
+    }
+
+    // wait until the rate counter is due, and (unless scrubbing always) until the design isn't writing.
+    // a word is read in the cycle it's issued, and written back in the next one, when nothing is issued.
+    RTLIL::Wire *issuedIn = nullptr;
+    auto *issued = addRegister(journal, builder, clock, "scrub_issued", RTLIL::Const(0, 1), issuedIn);
+    auto *notIssued = journal.addWire(tamaraId("scrub_not_issued"));
+    journal.recordCell(module->addNot(tamaraId("scrub_not_issued"), issued, notIssued));
+
+    RTLIL::SigSpec due = RTLIL::State::S1;
+    RTLIL::Wire *countIn = nullptr;
+    RTLIL::Wire *count = nullptr;
+    auto countWidth = std::max(1, ceil_log2(static_cast<int>(policy.rate)));
+    if (policy.rate > 1) {
+        count = addRegister(journal, builder, clock, "scrub_count", RTLIL::Const(0, countWidth), countIn);
+        auto *dueWire = journal.addWire(tamaraId("scrub_due"));
+        journal.recordCell(module->addEq(tamaraId("scrub_due"), count,
+            RTLIL::Const(static_cast<int>(policy.rate) - 1, countWidth), dueWire));
+        due = dueWire;
+    }
+
+    auto *ready = journal.addWire(tamaraId("scrub_ready"));
+    journal.recordCell(module->addAnd(tamaraId("scrub_ready"), due, notIssued, ready));
+    RTLIL::SigSpec issue = ready;
+    if (policy.arbitration == ScrubPolicy::Arbitration::Idle) {
+        RTLIL::SigSpec enables;
+        for (const auto &port : mem.wr_ports) {
+            enables.append(port.en);
+        }
+        auto *writing = journal.addWire(tamaraId("scrub_writing"));
+        journal.recordCell(module->addReduceOr(tamaraId("scrub_writing"), enables, writing));
+        auto *idle = journal.addWire(tamaraId("scrub_idle"));
+        journal.recordCell(module->addNot(tamaraId("scrub_idle"), writing, idle));
+        auto *issueWire = journal.addWire(tamaraId("scrub_issue"));
+        journal.recordCell(module->addAnd(tamaraId("scrub_issue"), ready, idle, issueWire));
+        issue = issueWire;
+    }
+    journal.connect(issuedIn, issue);
+
+    // the rate counter saturates once it's due, so that a scrub held off by the design isn't skipped
+    if (count != nullptr) {
+        auto *next = journal.addWire(tamaraId("scrub_count_next"), countWidth);
+        journal.recordCell(
+            module->addAdd(tamaraId("scrub_count_next"), count, RTLIL::Const(1, countWidth), next));
+        auto *held = journal.addWire(tamaraId("scrub_count_held"), countWidth);
+        journal.recordCell(module->addMux(tamaraId("scrub_count_held"), next, count, due, held));
+        journal.recordCell(
+            module->addMux(tamaraId("scrub_count_reset"), held, RTLIL::Const(0, countWidth), issue, countIn));
+    }
+
+    // the address moves on after each write back, wrapping around at the end of the memory
+    auto last = mem.start_offset + mem.size - 1;
+    auto addrWidth = std::max(1, ceil_log2(last + 1));
+    RTLIL::Wire *addrIn = nullptr;
+    auto *addr = addRegister(journal, builder, clock, "scrub_addr",
+        RTLIL::Const(mem.start_offset, addrWidth), addrIn);
+    auto *step = journal.addWire(tamaraId("scrub_addr_step"), addrWidth);
+    journal.recordCell(module->addAdd(tamaraId("scrub_addr_step"), addr, RTLIL::Const(1, addrWidth), step));
+    RTLIL::SigSpec next = step;
+    if (mem.start_offset != 0 || last + 1 != 1 << addrWidth) {
+        auto *atLast = journal.addWire(tamaraId("scrub_addr_last"));
+        journal.recordCell(
+            module->addEq(tamaraId("scrub_addr_last"), addr, RTLIL::Const(last, addrWidth), atLast));
+        auto *wrapped = journal.addWire(tamaraId("scrub_addr_wrap"), addrWidth);
+        journal.recordCell(module->addMux(
+            tamaraId("scrub_addr_wrap"), step, RTLIL::Const(mem.start_offset, addrWidth), atLast, wrapped));
+        next = wrapped;
+    }
+    journal.recordCell(module->addMux(tamaraId("scrub_addr_next"), addr, next, issued, addrIn));
+
+    // the write back goes first, and every other write port takes priority over it
+    auto *data = journal.addWire(tamaraId("scrub_data"), mem.width);
+    for (auto &port : mem.wr_ports) {
+        port.priority_mask.insert(port.priority_mask.begin(), true);
+    }
+    for (auto &port : mem.rd_ports) {
+        port.transparency_mask.insert(port.transparency_mask.begin(), false);
+        port.collision_x_mask.insert(port.collision_x_mask.begin(), false);
+    }
+    MemWr write;
+    write.clk_enable = true;
+    write.clk = clock.clk;
+    write.clk_polarity = clock.clk_polarity;
+    write.en = RTLIL::SigSpec(RTLIL::SigBit(issued), mem.width);
+    write.addr = addr;
+    write.data = data;
+    write.priority_mask = std::vector<bool>(mem.wr_ports.size() + 1, false);
+    mem.wr_ports.insert(mem.wr_ports.begin(), write);
+
+    // when scrubbing always, the read has to see the design's writes in the same cycle, otherwise they'd be
+    // overwritten by the old word on the next cycle
+    MemRd read;
+    read.clk_enable = true;
+    read.clk = clock.clk;
+    read.clk_polarity = clock.clk_polarity;
+    read.en = issue;
+    read.addr = addr;
+    read.data = data;
+    read.arst_value = RTLIL::Const(RTLIL::State::Sx, mem.width);
+    read.srst_value = RTLIL::Const(RTLIL::State::Sx, mem.width);
+    read.init_value = RTLIL::Const(RTLIL::State::Sx, mem.width);
+    read.transparency_mask = std::vector<bool>(mem.wr_ports.size(),
+        policy.arbitration == ScrubPolicy::Arbitration::Always);
+    read.transparency_mask.front() = false;
+    read.collision_x_mask = std::vector<bool>(mem.wr_ports.size(), false);
+    mem.rd_ports.push_back(read);
+
+    log("Scrubbing memory '%s' one word every %u cycles, %s\n", log_id(mem.memid), std::max(policy.rate, 2U),
+        policy.arbitration == ScrubPolicy::Arbitration::Idle ? "when it isn't being written" : "always");
+    return true;
+}
@@ -0,0 +1,87 @@
+// TaMaRa: An automated triple modular redundancy EDA flow for Yosys.
+//
+// Copyright (c) 2025 Matt Young.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
+// was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#include "tamara/netlist_graph.hpp"
+#include "kernel/log.h"
+#include "kernel/yosys_common.h"
+#include <cstdint>
+#include <vector>
+
+USING_YOSYS_NAMESPACE;
+
+using namespace tamara;
+
+namespace {
+
+//! Builds one direction of the CSR arrays from an edge list. Uses a stable counting sort, so that the
+//! neighbours of each node remain in insertion order.
+void buildCSR(size_t nodeCount, const std::vector<std::pair<NodeIndex, NodeIndex>> &edges, bool inverse,
+    std::vector<uint32_t> &offsets, std::vector<NodeIndex> &targets) {
+    offsets.assign(nodeCount + 1, 0);
+    targets.resize(edges.size());
+
+    for (const auto &[from, to] : edges) {
+        offsets.at((inverse ? to : from) + 1)++;
+    }
+    for (size_t i = 0; i < nodeCount; i++) {
+        offsets.at(i + 1) += offsets.at(i);
+    }
+
+    // cursor for each node's next free slot
+    std::vector<uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+    for (const auto &[from, to] : edges) {
+        auto source = inverse ? to : from;
+        auto target = inverse ? from : to;
+        targets.at(cursor.at(source)++) = target;
+    }
+}
+
+} // namespace
+
+NodeIndex NetlistGraph::Builder::addNode(const RTLILAnyPtr &ptr) {
+    auto [it, inserted] = indices.try_emplace(ptr, static_cast<NodeIndex>(nodes.size()));
+    if (inserted) {
+        nodes.push_back(ptr);
+    }
+    return it->second;
+}
+
+void NetlistGraph::Builder::addEdge(const RTLILAnyPtr &from, const RTLILAnyPtr &to) {
+    auto fromIndex = addNode(from);
+    auto toIndex = addNode(to);
+
+    // same semantics as the old map-of-sets: each edge only exists once
+    auto key = (static_cast<uint64_t>(fromIndex) << 32) | toIndex;
+    if (seenEdges.insert(key).second) {
+        edges.emplace_back(fromIndex, toIndex);
+    }
+}
+
+NetlistGraph NetlistGraph::Builder::build() {
+    if (nodes.size() >= INVALID_NODE) {
+        log_error("TaMaRa internal error: Netlist has too many nodes (%zu) to index!\n", nodes.size());
+    }
+
+    NetlistGraph graph;
+    buildCSR(nodes.size(), edges, false, graph.forwardOffsets, graph.forwardTargets);
+    buildCSR(nodes.size(), edges, true, graph.backwardOffsets, graph.backwardTargets);
+    graph.nodes = std::move(nodes);
+    graph.indices = std::move(indices);
+
+    // release the builder's scratch memory
+    edges = {};
+    seenEdges = {};
+    return graph;
+}
+
+std::vector<RTLILAnyPtr> NetlistGraph::resolve(std::span<const NodeIndex> range) const {
+    std::vector<RTLILAnyPtr> out {};
+    out.reserve(range.size());
+    for (auto index : range) {
+        out.push_back(nodes.at(index));
+    }
+    return out;
+}
@@ -0,0 +1,80 @@
+// TaMaRa: An automated triple modular redundancy EDA flow for Yosys.
+//
+// Copyright (c) 2025 Matt Young.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
+// was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#include "tamara/object_tags.hpp"
+#include "kernel/log.h"
+#include "kernel/rtlil.h"
+#include "kernel/yosys_common.h"
+#include "tamara/util.hpp"
+#include <string>
+
+USING_YOSYS_NAMESPACE;
+
+using namespace tamara;
+
+namespace {
+
+const ObjectTags *g_active_tags = nullptr;
+
+} // namespace
+
+ObjectTags::ObjectTags()
+    : previous(g_active_tags) {
+    g_active_tags = this;
+}
+
+ObjectTags::~ObjectTags() {
+    log_assert(g_active_tags == this && "ObjectTags must be destroyed in the reverse order they're created");
+    g_active_tags = previous;
+}
+
+const ObjectTags *ObjectTags::active() {
+    return g_active_tags;
+}
+
+void ObjectTags::tagReplicated(RTLIL::AttrObject *obj, Role role, uint32_t cone) {
+    log_assert(role != Role::Voter && "Voters are tagged with tagVoter");
+    tags[obj] = Tag { .cone = cone, .role = role };
+}
+
+void ObjectTags::tagVoter(RTLIL::AttrObject *obj) {
+    tags[obj] = Tag { .cone = NO_CONE, .role = Role::Voter };
+}
+
+std::optional<uint32_t> ObjectTags::getCone(RTLIL::AttrObject *obj) const {
+    auto it = tags.find(obj);
+    if (it == tags.end() || it->second.cone == NO_CONE) {
+        return std::nullopt;
+    }
+    return it->second.cone;
+}
+
+bool ObjectTags::isReplicated(RTLIL::AttrObject *obj) const {
+    if (getCone(obj).has_value()) {
+        return true;
+    }
+    return obj->get_bool_attribute(ORIGINAL_ANNOTATION) || obj->get_bool_attribute(REPLICA_ANNOTATION);
+}
+
+void ObjectTags::writeAttributes(bool cones) const {
+    size_t written = 0;
+    for (const auto &[obj, tag] : tags) {
+        if (tag.role == Role::Voter) {
+            obj->set_bool_attribute(VOTER_ANNOTATION);
+            written++;
+            continue;
+        }
+
+        obj->set_bool_attribute(tag.role == Role::Original ? ORIGINAL_ANNOTATION : REPLICA_ANNOTATION);
+        if (cones) {
+            obj->set_string_attribute(CONE_ANNOTATION, std::to_string(tag.cone));
+        } else {
+            obj->attributes.erase(CONE_ANNOTATION);
+        }
+        written++;
+    }
+    log("Wrote TaMaRa attributes for %zu of %zu tagged objects\n", written, tags.size());
+}
@@ -8,8 +8,10 @@
 #include "kernel/register.h"
 #include "kernel/rtlil.h"
 #include "kernel/yosys_common.h"
+#include "tamara/edit_journal.hpp"
 #include "tamara/logic_graph.hpp"
 #include "tamara/voter_builder.hpp"
+#include <chrono>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -41,6 +43,8 @@ struct TamaraDebug : public Pass {
         log("- countAll\n");
         log("- percentageVoter\n");
         log("- pause\n");
+        log("- benchPartition [iterations] [threads]\n");
+        log("- benchSearch [iterations] [threads] (same as benchPartition)\n");
     }
 
     void execute(std::vector<std::string> args, RTLIL::Design *design) override {
@@ -59,7 +63,8 @@ struct TamaraDebug : public Pass {
             log("Generating a %d bit voter\n", bits);
             auto *top = design->addModule(NEW_ID);
 
-            VoterBuilder builder(top);
+            EditJournal journal(top);
+            VoterBuilder builder(journal);
 
             // add inputs
             // note: these don't have the $ symbol, because they are top-level ports
@@ -83,6 +88,8 @@ struct TamaraDebug : public Pass {
             builder.build(a, b, c, out);
             builder.finalise(err);
 
+            journal.commit();
+            journal.getTags().writeAttributes(true);
             top->check();
         } else if (task == "replicateNot") {
             log("Hack to test replicating a NOT gate\n");
@@ -93,11 +100,18 @@ struct TamaraDebug : public Pass {
             }
 
             auto *notGate = findNot(top);
-            auto node = std::make_shared<tamara::ElementCellNode>(notGate, 0);
-            node->replicate(top);
+            tamara::CellPortOracle ports(design);
+            tamara::ConnectionIndex index(top, ports);
+            auto connections = tamara::analyseConnections(top, index);
+            auto node = std::make_shared<tamara::ElementCellNode>(notGate, connections.graph.find(notGate), 0);
+            tamara::EditJournal journal(top, &index);
+            node->replicate(top, journal);
+            journal.commit();
+            journal.getTags().writeAttributes(true);
 
             // fake cone so we can try inserting a voter
-            auto cone = tamara::LogicCone(notGate);
+            tamara::NodePool pool(connections.graph);
+            auto cone = tamara::LogicCone(notGate, pool);
             // cone.insertVoter(top);
         } else if (task == "countAll") {
             log("%zu\n", design->top_module()->cells().size() + design->top_module()->wires().size());
@@ -119,6 +133,11 @@ struct TamaraDebug : public Pass {
             // TODO
 
             log("%.2f%%\n", (voter / total) * 100.);
+        } else if (task == "benchPartition" || task == "benchSearch") {
+            // the cone search is now done by the partition, benchSearch is kept for existing scripts
+            auto iterations = args.size() > 2 ? static_cast<size_t>(std::stoul(args[2])) : 100;
+            auto threads = args.size() > 3 ? static_cast<size_t>(std::stoul(args[3])) : 1;
+            benchPartition(design, iterations, threads);
         } else if (task == "pause") {
             log("Press ENTER to continue from tamara_debug pause\n");
             std::string str;
@@ -131,6 +150,44 @@ struct TamaraDebug : public Pass {
         log_pop();
     }
 
+    //! Microbenchmark of LogicCone::partition: times partitioning the top module into logic cones, repeated
+    //! the given number of times with the given number of threads. Each iteration gets a fresh node pool,
+    //! which is created before the timer starts.
+    static void benchPartition(RTLIL::Design *design, size_t iterations, size_t threads) {
+        auto *top = design->top_module();
+        if (top == nullptr) {
+            log_error("No top module\n");
+        }
+
+        tamara::CellPortOracle ports(design);
+        tamara::ConnectionIndex index(top, ports);
+        auto connections = tamara::analyseConnections(top, index);
+
+        std::vector<RTLIL::Wire *> outputs;
+        for (auto *wire : top->wires()) {
+            if (wire->port_output && !wire->has_attribute(ERROR_SINK_ANNOTATION)) {
+                outputs.push_back(wire);
+            }
+        }
+
+        double total = 0;
+        size_t cones = 0;
+        for (size_t i = 0; i < iterations; i++) {
+            tamara::NodePool pool(connections.graph);
+
+            auto begin = std::chrono::steady_clock::now();
+            cones = tamara::LogicCone::partition(outputs, connections, pool, threads).size();
+            auto end = std::chrono::steady_clock::now();
+
+            total += std::chrono::duration<double, std::micro>(end - begin).count();
+        }
+
+        log("%zu partitions into %zu cones (%zu graph nodes, %zu threads) took %.2f ms, %.2f us per "
+            "partition\n",
+            iterations, cones, connections.graph.size(), threads, total / 1000.,
+            iterations == 0 ? 0. : total / static_cast<double>(iterations));
+    }
+
     static RTLIL::Cell *findNot(RTLIL::Module *module) {
         for (const auto &cell : module->cells()) {
             if (cell->type == ID($logic_not)) {
@@ -5,21 +5,32 @@
 // This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
 // was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #include "kernel/log.h"
+#include "kernel/mem.h"
 #include "kernel/register.h"
 #include "kernel/rtlil.h"
 #include "kernel/yosys.h"
 #include "kernel/yosys_common.h"
+#include "tamara/edit_journal.hpp"
 #include "tamara/logic_graph.hpp"
+#include "tamara/memory_scrubber.hpp"
 #include "tamara/termcolour.hpp"
 #include "tamara/util.hpp"
 #include "tamara/voter_builder.hpp"
+#include <algorithm>
+#include <array>
 #include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <thread>
 #include <vector>
 
 USING_YOSYS_NAMESPACE;
 
 namespace {
 
+//! Name of the error port added to child modules in hierarchical mode
+const auto ERROR_PORT_NAME = ID(tamara_err);
+
 /// Locates and marks $mem cells as ignored
 void markMemoriesIgnored(RTLIL::Module *module) {
     bool haveWarned = false;
@@ -37,6 +48,22 @@ void markMemoriesIgnored(RTLIL::Module *module) {
     }
 }
 
+//! Sets the naming mode for as long as it's alive, and goes back to full names when it goes out of scope, so
+//! the mode doesn't leak into later commands even if the pass errors out
+class CompactNamesScope {
+public:
+    explicit CompactNamesScope(bool compact) {
+        tamara::setCompactNames(compact);
+    }
+
+    ~CompactNamesScope() {
+        tamara::setCompactNames(false);
+    }
+
+    CompactNamesScope(const CompactNamesScope &) = delete;
+    CompactNamesScope &operator=(const CompactNamesScope &) = delete;
+};
+
 }; // namespace
 
 namespace tamara {
@@ -51,7 +78,7 @@ struct TamaraTMRPass : public Pass {
     void help() override {
         //   |---v---|---v---|---v---|---v---|---v---|---v---|---v---|---v---|---v---|---v---|
         log("\n");
-        log("    tamara_tmr\n");
+        log("    tamara_tmr [options]\n");
         log("\n");
 
         log("TaMaRa is an automated Triple Modular Redundancy flow for Yosys. The\n");
@@ -59,12 +86,109 @@ struct TamaraTMRPass : public Pass {
         log("should be the top module. It will apply TMR and insert majority voters.\n");
         log("\n");
         log("The 'tamara_tmr' command should be run after synthesis but before technology\n");
-        log("mapping. TaMaRa aims to be able to process all Yosys-compatible designs, but\n");
-        log("requires a small amount of special preparation to work correctly. In particular,\n");
-        log("the 'split_cells' and 'split_nets' commands must be run _before_ TaMaRa, and the\n");
-        log("user should define a wire in the top module as the error signal using the (*\n");
-        log("tamara_error_sink*) annotation. It is advised to run `opt_clean` after TaMaRa,\n");
-        log("but strictly no other optimisation passes, as they remove the TMR logic.\n");
+        log("mapping. TaMaRa aims to be able to process all Yosys-compatible designs.\n");
+        log("Connectivity is tracked per bit, so multi-bit cells and wires don't need to be\n");
+        log("split first. The user should define a wire in the top module as the error signal\n");
+        log("using the (* tamara_error_sink *) annotation. It is advised to run `opt_clean`\n");
+        log("after TaMaRa, but strictly no other optimisation passes, as they remove the TMR\n");
+        log("logic.\n");
+        log("\n");
+        log("    -j <threads>\n");
+        log("        Analyse the connections of the module, and search its logic cones, using up to\n");
+        log("        this many threads. A value of 0 uses one thread per hardware thread. The netlist\n");
+        log("        produced is the same no matter how many threads are used. Default: 1\n");
+        log("\n");
+        log("    -verify none|end|cone|paranoid\n");
+        log("        How often to check the netlist for consistency while editing it. 'end' checks\n");
+        log("        the module once when TMR is complete. 'cone' also checks each edited cell, and\n");
+        log("        the module after each logic cone is wired. 'paranoid' also checks the whole\n");
+        log("        module after every wire, cell, port and connection added or changed for the\n");
+        log("        replicas and voters, which is very slow on large designs. Default: end\n");
+        log("\n");
+        log("    -hierarchical\n");
+        log("        Instead of only the top module, apply TMR to every selected module once,\n");
+        log("        bottom-up, so the design doesn't need to be flattened first. Instances of a\n");
+        log("        hardened module are left as they are, and share its definition. A child module\n");
+        log("        without an error sink gets a new 'tamara_err' output port, which is routed to\n");
+        log("        the error sink of each parent. The inputs of each instance are voted like\n");
+        log("        outputs, so the logic in the parent that drives them is triplicated too.\n");
+        log("\n");
+        log("    -voters ff|every:<n>|outputs|annotated\n");
+        log("        Where to insert voters. 'ff' votes after every FF. 'every:<n>' votes after every\n");
+        log("        n-th FF on the way back from an output. 'outputs' only votes at the outputs.\n");
+        log("        'annotated' votes at the outputs, and after FFs whose register is marked\n");
+        log("        (* tamara_vote *). Outputs are always voted. Fewer voters means less area and\n");
+        log("        delay, but an upset stays in the replica it hit until it reaches a voter.\n");
+        log("        Default: ff\n");
+        log("\n");
+        log("    -word_voters\n");
+        log("        Build each voter from multi-bit $and/$or/$xor cells covering the whole signal,\n");
+        log("        instead of a separate network of 1-bit gates for every bit. This is the same\n");
+        log("        logic, but adds far fewer cells and wires to wide datapaths.\n");
+        log("\n");
+        log("    -voter_cell\n");
+        log("        Insert one $__tmr_voter cell per voted signal, instead of building the voter\n");
+        log("        from logic. It must be lowered after TMR with 'techmap -map\n");
+        log("        src/tmr_voter_map.v' (logic gates) or 'techmap -map src/tmr_voter_lut3_map.v'\n");
+        log("        (one 3-input LUT per bit, for FPGAs).\n");
+        log("\n");
+        log("    -err_fanin <k>\n");
+        log("        The voter error signals are OR'd together into the error sink by a balanced\n");
+        log("        tree, where each node has up to this many inputs, so the error path has a\n");
+        log("        depth of log_k(voters). 0 uses a single wide $reduce_or instead. Default: 2\n");
+        log("\n");
+        log("    -err_pipeline <k> -err_clock <wire>\n");
+        log("        Register the error tree every k levels and at its root, with FFs clocked by the\n");
+        log("        rising edge of the given 1-bit wire, so it doesn't limit Fmax. Errors then reach\n");
+        log("        the error sink max(1, ceil(depth / k)) cycles late, where depth is the depth of\n");
+        log("        the tree. With -hierarchical, this includes the latency of child modules, and\n");
+        log("        every other error is delayed to match it. The number of cycles is logged for\n");
+        log("        each module. 0 disables this. Default: 0\n");
+        log("\n");
+        log("    -compact_names\n");
+        log("        Name replicas and TaMaRa's own wires and cells with short base-36 IDs, instead\n");
+        log("        of extending the original names. This saves memory and makes the netlist\n");
+        log("        faster to write out on large designs.\n");
+        log("\n");
+        log("    -name_map <file>\n");
+        log("        With -compact_names, write a JSON file mapping every replica to the name of\n");
+        log("        the original it was copied from.\n");
+        log("\n");
+        log("    -annotate\n");
+        log("        Also mark every replicated object and its replicas with the index of their\n");
+        log("        logic cone, (* tamara_cone *). Originals are always marked with\n");
+        log("        (* tamara_original *) and replicas with (* tamara_replica *), so that running\n");
+        log("        the pass again leaves them alone, and voters with (* tamara_voter *), so that\n");
+        log("        fault injection can skip them.\n");
+        log("\n");
+        log("    -memories\n");
+        log("        Triplicate memories, instead of leaving them as a single point of failure. All\n");
+        log("        three copies share the same write and read ports, and the data from each read\n");
+        log("        port is voted before it's used. Memories marked (* tamara_ignore *) are left\n");
+        log("        alone. Has no effect with -coarse, which triplicates memories anyway.\n");
+        log("\n");
+        log("    -memory_word_voters\n");
+        log("        Like -word_voters, but only for memory read data. Implies -memories.\n");
+        log("\n");
+        log("    -scrub_rate <n>\n");
+        log("        Add a scrubber to each triplicated memory, which reads one word from all three\n");
+        log("        copies every n cycles (every 2 if n is 1), and writes the voted word back to\n");
+        log("        them on the next cycle. This corrects upsets before they accumulate in\n");
+        log("        more than one copy. It uses an extra read and write port, clocked by the write\n");
+        log("        ports of the memory, which must share a clock. Its registers are triplicated,\n");
+        log("        so that one upset can't make it write to the wrong word. Implies -memories. 0\n");
+        log("        disables scrubbing. Default: 0\n");
+        log("\n");
+        log("    -scrub_policy idle|always\n");
+        log("        When the scrubber may use the memory. 'idle' only scrubs in cycles where the\n");
+        log("        design doesn't write to it. 'always' scrubs regardless, and the design's writes\n");
+        log("        take priority over the scrubber's. Default: idle\n");
+        log("\n");
+        log("    -coarse\n");
+        log("        Instead of replicating each logic cone and voting at every register, move the\n");
+        log("        body of the top module into a new module, instantiate it three times, and only\n");
+        log("        vote on its output ports. This is much cheaper to run, but a fault in one\n");
+        log("        register is only masked, never corrected. Can't be combined with -hierarchical.\n");
         log("\n");
         log("For more information, please read the TaMaRa documentation, which is available\n");
         log("at: https://github.com/mattyoung101/tamara\n");
@@ -77,26 +201,219 @@ struct TamaraTMRPass : public Pass {
     void execute(std::vector<std::string> args, RTLIL::Design *design) override {
         log_header(design, "Running TaMaRa automated Triple Modular Redundancy flow\n\n");
 
+        Options options;
+
+        size_t argidx;
+        bool scrubPolicyGiven = false;
+        for (argidx = 1; argidx < args.size(); argidx++) {
+            if (args[argidx] == "-j" && argidx + 1 < args.size()) {
+                auto requested = atoi(args[++argidx].c_str());
+                if (requested < 0) {
+                    log_cmd_error("Number of threads must not be negative, got %d\n", requested);
+                }
+                options.threads = requested == 0 ? std::max(1U, std::thread::hardware_concurrency())
+                                                 : static_cast<size_t>(requested);
+                continue;
+            }
+            if (args[argidx] == "-verify" && argidx + 1 < args.size()) {
+                auto level = parseVerifyLevel(args[++argidx]);
+                if (!level.has_value()) {
+                    log_cmd_error("Unknown verify level '%s'\n", args[argidx].c_str());
+                }
+                options.verify = level.value();
+                continue;
+            }
+            if (args[argidx] == "-hierarchical") {
+                options.hierarchical = true;
+                continue;
+            }
+            if (args[argidx] == "-voters" && argidx + 1 < args.size()) {
+                auto policy = parseVoterPolicy(args[++argidx]);
+                if (!policy.has_value()) {
+                    log_cmd_error("Unknown voter policy '%s'\n", args[argidx].c_str());
+                }
+                options.voters = policy.value();
+                continue;
+            }
+            if (args[argidx] == "-word_voters") {
+                options.voterStyle = VoterStyle::Word;
+                continue;
+            }
+            if (args[argidx] == "-voter_cell") {
+                options.voterStyle = VoterStyle::Cell;
+                continue;
+            }
+            if (args[argidx] == "-err_fanin" && argidx + 1 < args.size()) {
+                auto fanIn = atoi(args[++argidx].c_str());
+                if (fanIn < 0 || fanIn == 1) {
+                    log_cmd_error("Error fan-in must be 0, or at least 2, got %d\n", fanIn);
+                }
+                options.errorFanIn = static_cast<size_t>(fanIn);
+                continue;
+            }
+            if (args[argidx] == "-err_pipeline" && argidx + 1 < args.size()) {
+                auto every = atoi(args[++argidx].c_str());
+                if (every < 0) {
+                    log_cmd_error("Error pipeline interval must not be negative, got %d\n", every);
+                }
+                options.errorPipelineEvery = static_cast<size_t>(every);
+                continue;
+            }
+            if (args[argidx] == "-err_clock" && argidx + 1 < args.size()) {
+                options.errorClock = RTLIL::escape_id(args[++argidx]);
+                continue;
+            }
+            if (args[argidx] == "-compact_names") {
+                options.compactNames = true;
+                continue;
+            }
+            if (args[argidx] == "-name_map" && argidx + 1 < args.size()) {
+                options.nameMap = args[++argidx];
+                continue;
+            }
+            if (args[argidx] == "-annotate") {
+                options.annotate = true;
+                continue;
+            }
+            if (args[argidx] == "-memories") {
+                options.memories = true;
+                continue;
+            }
+            if (args[argidx] == "-memory_word_voters") {
+                options.memories = true;
+                options.memoryWordVoters = true;
+                continue;
+            }
+            if (args[argidx] == "-scrub_rate" && argidx + 1 < args.size()) {
+                auto rate = atoi(args[++argidx].c_str());
+                if (rate < 0) {
+                    log_cmd_error("Scrub rate must not be negative, got %d\n", rate);
+                }
+                options.scrub.rate = static_cast<uint32_t>(rate);
+                options.memories = options.memories || rate != 0;
+                continue;
+            }
+            if (args[argidx] == "-scrub_policy" && argidx + 1 < args.size()) {
+                scrubPolicyGiven = true;
+                auto arbitration = parseScrubArbitration(args[++argidx]);
+                if (!arbitration.has_value()) {
+                    log_cmd_error("Unknown scrub policy '%s'\n", args[argidx].c_str());
+                }
+                options.scrub.arbitration = arbitration.value();
+                continue;
+            }
+            if (args[argidx] == "-coarse") {
+                options.coarse = true;
+                continue;
+            }
+            break;
+        }
+        extra_args(args, argidx, design);
+
+        if (options.errorPipelineEvery != 0 && options.errorClock.empty()) {
+            log_cmd_error("-err_pipeline requires a clock to be given with -err_clock\n");
+        }
+        if (!options.nameMap.empty() && !options.compactNames) {
+            log_cmd_error("-name_map requires -compact_names\n");
+        }
+        if (scrubPolicyGiven && options.scrub.rate == 0) {
+            log_cmd_error("-scrub_policy requires -scrub_rate\n");
+        }
+        if (options.coarse && options.hierarchical) {
+            log_cmd_error("-coarse and -hierarchical can't be used together\n");
+        }
+
         // FIXME: find module marked (* tamara_triplicate *)
 
-        // we can only operate on one module
+        // we can only operate on one module, unless we're hierarchical
         if (design->top_module() == nullptr) {
             log_error("No top module selected\n");
         }
 
-        auto *const module = design->top_module();
-        log("Applying TMR to top module: %s\n", log_id(module->name));
-        log_push();
+        CompactNamesScope names(options.compactNames);
+        hardened.clear();
+        if (options.hierarchical) {
+            auto modules = getModulesBottomUp(design);
+            log("Applying hierarchical TMR to %zu module(s)\n", modules.size());
+            for (auto *module : modules) {
+                processModule(design, module, options);
+            }
+        } else if (options.coarse) {
+            processModuleCoarse(design, design->top_module(), options);
+        } else {
+            processModule(design, design->top_module(), options);
+        }
+
+        if (!options.nameMap.empty()) {
+            writeNameMap(options.nameMap);
+        }
+    }
 
-        VoterBuilder builder(module);
+private:
+    //! Options given to the pass on the command line
+    struct Options {
+        size_t threads = 1;
+        VerifyLevel verify = VerifyLevel::End;
+        bool hierarchical = false;
+        bool coarse = false;
+        VoterPolicy voters;
+        VoterStyle voterStyle = VoterStyle::Gate;
+        size_t errorFanIn = 2;
+        size_t errorPipelineEvery = 0;
+        RTLIL::IdString errorClock;
+        bool compactNames = false;
+        std::string nameMap;
+        bool annotate = false;
+        bool memories = false;
+        bool memoryWordVoters = false;
+        ScrubPolicy scrub;
+    };
+
+    std::optional<RTLIL::Wire *> errorSink;
+
+    //! A module that has already been hardened in hierarchical mode
+    struct HardenedModule {
+        //! Name of the output port that carries its error signal
+        RTLIL::IdString errorPort;
+        //! Number of cycles its error signal lags behind the errors it reports
+        size_t errorLatency = 0;
+    };
+
+    //! Modules that have already been hardened in hierarchical mode
+    dict<RTLIL::IdString, HardenedModule> hardened;
+
+    //! Applies TMR to one module
+    // NOLINTNEXTLINE(readability-function-cognitive-complexity)
+    void processModule(RTLIL::Design *design, RTLIL::Module *module, const Options &options) {
+        auto isTop = module == design->top_module();
+        log("Applying TMR to %s module: %s\n", isTop ? "top" : "child", log_id(module->name));
+        log_push();
 
         // locate the error sink (place where we route the voter 'err' signals too)
         log_header(design, "Locating error sink\n");
-        locateErrorSink(design->top_module());
+        locateErrorSink(module, options.hierarchical && !isTop);
+
+        // the memory voters and the rest of the voters have separate error trees, but both are pipelined
+        auto *errorClock = locateErrorClock(module, options, options.hierarchical && !isTop);
+
+        // either triplicate memories up front, or tag them as ignore
+        std::pair<RTLIL::Wire *, size_t> memoryError { nullptr, 0 };
+        if (options.memories) {
+            log_header(design, "Triplicating memories\n");
+            memoryError = triplicateMemories(module, options, errorClock);
+        } else {
+            log_header(design, "Locating and marking memories as ignored\n");
+            markMemoriesIgnored(module);
+        }
 
-        // tag memories as ignore
-        log_header(design, "Locating and marking memories as ignored\n");
-        markMemoriesIgnored(module);
+        // instances of modules we've already hardened are left alone, other than collecting their errors
+        std::vector<std::pair<RTLIL::Wire *, size_t>> instanceErrors;
+        std::vector<RTLIL::Wire *> instanceInputs;
+        if (!hardened.empty()) {
+            log_header(design, "Locating hardened instances\n");
+            instanceErrors = connectHardenedInstances(module);
+            instanceInputs = splitHardenedInstanceInputs(module);
+        }
 
 #if defined(TAMARA_DEBUG)
         if (getenv("TAMARA_DEBUG_BYPASS_VOTER") != nullptr) {
@@ -111,82 +428,203 @@ struct TamaraTMRPass : public Pass {
         // analyse wire connections, this is used later by the logic cone code for neighbour calculations
         // I thought that we might be able to get this through RTLIL directly, but I think we have to compute
         // it ourselves.
-        // the main trouble is we have to compute it in reverse: that is, we want to know which _wires_ have
-        // which _cells_ associated with them, but RTLIL will only tell us which _cells_ have which _wires_
-        // associated with them.
+        // the main trouble is we have to compute it in reverse: that is, we want to know which _cells_ drive
+        // the bits a cell reads, but RTLIL will only tell us which _wires_ each cell is connected to.
         log_header(design, "Analysing connections\n");
-        auto connections = analyseAll(module);
+        // cell port directions are looked up constantly, so build the table once and share it
+        CellPortOracle ports(design);
+        // every driver and load of every bit, normalised through a SigMap. the fix-up passes need to see our
+        // edits as we make them, so this is updated as cells, ports and connections are edited.
+        ConnectionIndex liveConnections(module, ports, options.threads);
+        // a snapshot of the original netlist taken from the index before it's edited, which is what the cone
+        // search runs on
+        auto connections = analyseConnections(module, liveConnections);
+        // every edit goes through the journal, which keeps the live connections up to date in batches
+        EditJournal journal(module, &liveConnections, options.verify);
+        VoterBuilder builder(journal, options.voterStyle);
+        builder.setErrorFanIn(options.errorFanIn);
+        builder.setErrorPipeline(errorClock != nullptr ? options.errorPipelineEvery : 0, errorClock);
+        for (const auto &[wire, latency] : instanceErrors) {
+            builder.addErrorSource(wire, latency);
+        }
+        if (memoryError.first != nullptr) {
+            builder.addErrorSource(memoryError.first, memoryError.second);
+        }
+
+        // every cone takes its nodes from here, so it must be declared before (and outlive) the cones
+        NodePool nodePool(connections.graph);
 
         // figure out where our output ports are, these will be the start of the BFS
-        log_header(design, "Computing initial logic graph\n");
+        log_header(design, "Computing logic graph\n");
         auto outputs = getOutputPorts(module);
         log("Module has %zu output ports, %zu selected cells\n\n", outputs.size(),
             module->selected_cells().size());
 
-        DUMPASYNC;
-
-        // this is a list of successors generated by the backwards BFS
-        auto successors = std::queue<LogicCone>();
-
-        for (const auto &output : outputs) {
-            // don't consider ports marked (* tamara_error_sink *)
+        // don't consider ports marked (* tamara_error_sink *)
+        std::erase_if(outputs, [](RTLIL::Wire *output) {
             if (output->has_attribute(ERROR_SINK_ANNOTATION)) {
-                log("Skipping output '%s', marked as TaMaRa error sink\n\n", log_id(output->name));
-                continue;
+                log("Skipping output '%s', marked as TaMaRa error sink\n", log_id(output->name));
+                return true;
             }
+            return false;
+        });
 
-            log("Searching from output port %s\n", log_id(output->name));
-            auto cone = LogicCone(output);
+        // the inputs of hardened instances are voted like outputs, otherwise the logic that only drives them
+        // would never be reached from an output, and would be left as it is
+        outputs.insert(outputs.end(), instanceInputs.begin(), instanceInputs.end());
 
-            // start at the output port, do a BFS backwards to build up our logic cones
-            cone.search(connections);
-            log("\n");
+        DUMPASYNC;
 
+        // cut the netlist at every FF and IO in one sweep, this gives us the cones from the outputs followed
+        // by the cones from every FF that feeds them
+        auto cones = LogicCone::partition(outputs, connections, nodePool, options.threads);
+        log("Partitioned module into %zu logic cones\n", cones.size());
+        LogicCone::applyVoterPolicy(cones, options.voters);
+
+        log_header(design, "Replicating and wiring logic cones\n");
+        // replicated bits are remembered across cones, so that later cones read the matching replica, and
+        // don't vote a bit that an earlier cone already has
+        ReplicaMap replicas;
+        for (auto &cone : cones) {
             // cone is built, replicate items
-            cone.replicate(module);
+            cone.replicate(connections, journal, replicas);
             log("\n");
 
             // wire up the netlist, and insert a voter
-            cone.wire(module, connections, builder);
+            cone.wire(module, connections, journal, builder, replicas);
             log("\n");
+        }
 
-            // generate successors
-            auto coneSuccessors = cone.buildSuccessors(connections);
-            for (const auto &successor : coneSuccessors) {
-                successors.push(successor);
-            }
-            log("\n");
+        // collect all error signals from all voters in the design, ORs them together, and connects them to
+        // the (* tamara_error_sink *) node (if it exists).
+        log_header(design, "Sinking error nodes into (* tamara_error_sink *)\n");
+        size_t errorLatency = 0;
+        if (errorSink.has_value()) {
+            log("Sinking %zu voters and %zu hardened instances into (* tamara_error_sink *) %s\n",
+                builder.getSize(), instanceErrors.size(), log_id(errorSink.value()->name));
+            errorLatency = builder.finalise(errorSink.value());
+        } else {
+            log_warning("Cannot sink voters into error sink because no error sink was found!\n");
         }
 
+        // unless asked for with -verify, the module is only checked once, here
+        journal.commit();
+        journal.verify(VerifyLevel::End);
+        journal.getTags().writeAttributes(options.annotate);
+        for (auto *wire : instanceInputs) {
+            wire->attributes.erase(INSTANCE_INPUT_ANNOTATION);
+        }
+
+        if (options.hierarchical && errorSink.has_value()) {
+            hardened[module->name] = { .errorPort = errorSink.value()->name, .errorLatency = errorLatency };
+        }
+
+        log("\n===============================\n");
+        log("%sTaMaRa TMR pass completed!%s\n", termcolour::colour(termcolour::Colour::Green).c_str(),
+            termcolour::reset().c_str());
+        log("===============================\n");
+        log_pop();
+
+#if TAMARA_DEBUG
+        if (getenv("TAMARA_DEBUG_AGGRESSIVE_CLEAN") != nullptr) {
+            Yosys::run_pass("opt_clean");
+        }
+#endif
         DUMPASYNC;
+    }
 
-        log_header(design, "Computing successor logic graph (%zu successors)\n", successors.size());
-        while (!successors.empty()) {
-            auto cone = successors.front();
-            successors.pop();
+    //! Applies module-level TMR to one module: its body is moved into a new module, which is instantiated
+    //! three times with the same inputs, and voters are only inserted on the outputs. Apart from the clone
+    //! itself, this is linear in the number of ports.
+    void processModuleCoarse(RTLIL::Design *design, RTLIL::Module *module, const Options &options) {
+        log("Applying coarse TMR to module: %s\n", log_id(module->name));
+        log_push();
 
-            // start at the output port, do a BFS backwards to build up our logic cones
-            cone.search(connections);
-            log("\n");
+        log_header(design, "Locating error sink\n");
+        locateErrorSink(module, false);
+        // everything but the ports is moved into the replicas, so an internal sink wouldn't survive
+        if (errorSink.has_value() && !errorSink.value()->port_output) {
+            log_error("Error sink '%s' must be an output port of module %s for coarse TMR\n",
+                log_id(errorSink.value()->name), log_id(module->name));
+        }
 
-            // cone is built, replicate items
-            cone.replicate(module);
-            log("\n");
+        // move the body of the module into a copy, which keeps the same ports
+        log_header(design, "Moving module body into replica module\n");
+        RTLIL::IdString innerName = module->name.str() + "_tamara_coarse";
+        if (design->module(innerName) != nullptr) {
+            log_error("Module %s already exists, has coarse TMR already been applied to %s?\n",
+                log_id(innerName), log_id(module->name));
+        }
+        auto *inner = module->clone();
+        inner->name = innerName;
+        inner->attributes.erase(ID::top);
+        design->add(inner);
+
+        // then strip the original down to its ports, which is where the replicas and voters will go
+        pool<RTLIL::Wire *> internalWires;
+        for (auto *wire : module->wires()) {
+            if (wire->port_id == 0) {
+                internalWires.insert(wire);
+            }
+        }
+        for (auto *cell : module->cells().to_vector()) {
+            module->remove(cell);
+        }
+        std::vector<RTLIL::Process *> processes;
+        for (const auto &process : module->processes) {
+            processes.push_back(process.second);
+        }
+        for (auto *process : processes) {
+            module->remove(process);
+        }
+        for (const auto &memory : module->memories) {
+            delete memory.second;
+        }
+        module->memories.clear();
+        module->new_connections({});
+        module->remove(internalWires);
+        log("Moved body of %s into %s\n", log_id(module->name), log_id(inner->name));
+
+        log_header(design, "Instantiating replicas and inserting voters\n");
+        EditJournal journal(module, nullptr, options.verify);
+        VoterBuilder builder(journal, options.voterStyle);
+        builder.setErrorFanIn(options.errorFanIn);
+        builder.setErrorPipeline(options.errorPipelineEvery, locateErrorClock(module, options, false));
+
+        std::array<RTLIL::Cell *, 3> replicas {};
+        for (auto &replica : replicas) {
+            replica = module->addCell(tamaraId("coarse_replica"), inner->name);
+            replica->set_bool_attribute(IGNORE_ANNOTATION);
+            journal.recordCell(replica);
+        }
 
-            // wire up the netlist
-            cone.wire(module, connections, builder);
-            log("\n");
+        for (const auto &portName : module->ports) {
+            auto *port = module->wire(portName);
+            if (port->port_input && port->port_output) {
+                log_error("Inout port '%s' is not supported by coarse TMR\n", log_id(port->name));
+            }
+            if (port->port_input) {
+                for (auto *replica : replicas) {
+                    journal.setPort(replica, portName, port);
+                }
+                continue;
+            }
+            if (errorSink.has_value() && port == errorSink.value()) {
+                // the replicas have no voters of their own, so their error sinks are left unconnected
+                continue;
+            }
 
-            // generate successors
-            auto coneSuccessors = cone.buildSuccessors(connections);
-            for (const auto &successor : coneSuccessors) {
-                successors.push(successor);
+            std::array<RTLIL::Wire *, 3> outputs {};
+            for (size_t i = 0; i < replicas.size(); i++) {
+                // the whole module is one replica, so it's named as cone 0
+                outputs.at(i) = journal.addWire(replicaId(port->name, static_cast<int>(i) + 1, 0), port);
+                outputs.at(i)->port_output = false;
+                outputs.at(i)->port_id = 0;
+                journal.setPort(replicas.at(i), portName, outputs.at(i));
             }
-            log("\n");
+            builder.build(outputs.at(0), outputs.at(1), outputs.at(2), port);
         }
 
-        // collect all error signals from all voters in the design, ORs them together, and connects them to
-        // the (* tamara_error_sink *) node (if it exists).
         log_header(design, "Sinking error nodes into (* tamara_error_sink *)\n");
         if (errorSink.has_value()) {
             log("Sinking %zu voters into (* tamara_error_sink *) %s\n", builder.getSize(),
@@ -196,22 +634,234 @@ struct TamaraTMRPass : public Pass {
             log_warning("Cannot sink voters into error sink because no error sink was found!\n");
         }
 
+        journal.commit();
+        journal.verify(VerifyLevel::End);
+        journal.getTags().writeAttributes(options.annotate);
+
         log("\n===============================\n");
-        log("%sTaMaRa TMR pass completed!%s\n", termcolour::colour(termcolour::Colour::Green).c_str(),
-            termcolour::reset().c_str());
+        log("%sTaMaRa coarse TMR pass completed!%s\n",
+            termcolour::colour(termcolour::Colour::Green).c_str(), termcolour::reset().c_str());
         log("===============================\n");
         log_pop();
+        DUMPASYNC;
+    }
 
-#if TAMARA_DEBUG
-        if (getenv("TAMARA_DEBUG_AGGRESSIVE_CLEAN") != nullptr) {
-            Yosys::run_pass("opt_clean");
+    //! Triplicates every memory in the module that isn't marked (* tamara_ignore *), and votes the data from
+    //! each of its read ports. The copies share the write and read ports of the original, apart from the
+    //! read data. This has to happen before the module is analysed: the memories and their voters are marked
+    //! as ignored, so the voted read data is treated like any other signal without a driver. The voters have
+    //! their own error tree, pipelined on `errorClock` like the main one if it's given. Returns the error
+    //! signal of the voters and its latency, or nullptr if no memories were triplicated.
+    static std::pair<RTLIL::Wire *, size_t> triplicateMemories(
+        RTLIL::Module *module, const Options &options, RTLIL::Wire *errorClock) {
+        pool<RTLIL::Cell *> existing;
+        for (auto *cell : module->cells()) {
+            existing.insert(cell);
         }
-#endif
-        DUMPASYNC;
+
+        EditJournal journal(module, nullptr, options.verify);
+        VoterBuilder builder(journal, options.memoryWordVoters ? VoterStyle::Word : options.voterStyle);
+        builder.setErrorFanIn(options.errorFanIn);
+        builder.setErrorPipeline(errorClock != nullptr ? options.errorPipelineEvery : 0, errorClock);
+
+        size_t triplicated = 0;
+        for (auto &mem : Mem::get_all_memories(module)) {
+            if (mem.has_attribute(IGNORE_ANNOTATION)) {
+                log("Memory '%s' is marked as ignored, it will NOT be triplicated\n", log_id(mem.memid));
+                continue;
+            }
+            // the copies are emitted as $mem_v2 cells, so the original is packed into one as well
+            mem.packed = true;
+            mem.set_bool_attribute(IGNORE_ANNOTATION);
+            // the scrubber's ports are added before copying, and its read port is voted like the others
+            if (options.scrub.rate != 0) {
+                addScrubber(journal, builder, mem, options.scrub);
+            }
+
+            std::array<Mem, 2> replicas { mem, mem };
+            for (size_t i = 0; i < replicas.size(); i++) {
+                auto &replica = replicas.at(i);
+                replica.memid = mem.memid.str() + replicaMarker(static_cast<int>(i + 1));
+                replica.mem = nullptr;
+                replica.cell = nullptr;
+                for (auto &port : replica.rd_ports) {
+                    port.cell = nullptr;
+                }
+                for (auto &port : replica.wr_ports) {
+                    port.cell = nullptr;
+                }
+                for (auto &init : replica.inits) {
+                    init.cell = nullptr;
+                }
+            }
+
+            for (size_t port = 0; port < mem.rd_ports.size(); port++) {
+                auto &original = mem.rd_ports.at(port);
+                auto width = GetSize(original.data);
+
+                std::array<RTLIL::Wire *, 3> data {};
+                for (auto &wire : data) {
+                    wire = journal.addWire(tamaraId("mem_rd_data"), width);
+                }
+                auto *voted = journal.addWire(tamaraId("mem_rd_voted"), width);
+                journal.connect(original.data, voted);
+
+                original.data = data.at(0);
+                replicas.at(0).rd_ports.at(port).data = data.at(1);
+                replicas.at(1).rd_ports.at(port).data = data.at(2);
+                builder.build(data.at(0), data.at(1), data.at(2), voted);
+            }
+
+            mem.emit();
+            journal.recordCell(mem.cell);
+            for (auto &replica : replicas) {
+                replica.emit();
+                journal.recordCell(replica.cell);
+            }
+            log("Triplicated memory '%s' (%d words of %d bits), voting %zu read port(s)\n", log_id(mem.memid),
+                mem.size, mem.width, mem.rd_ports.size());
+            triplicated++;
+        }
+
+        if (triplicated == 0) {
+            return { nullptr, 0 };
+        }
+
+        auto *err = journal.addWire(tamaraId("mem_err"));
+        auto latency = builder.finalise(err);
+        journal.commit();
+        journal.getTags().writeAttributes(false);
+
+        // voters aren't normally ignored, so that TMR can be applied more than once as a test. these ones
+        // have to be, otherwise the analysis would find them and replicate them like any other logic.
+        for (auto *cell : module->cells()) {
+            if (!existing.contains(cell)) {
+                cell->set_bool_attribute(IGNORE_ANNOTATION);
+            }
+        }
+        return { err, latency };
     }
 
-private:
-    std::optional<RTLIL::Wire *> errorSink;
+    //! Looks up the clock for the error tree pipeline in the module, if one is needed. If `optional` is set,
+    //! a module without the clock gets an unregistered error tree instead of an error, which is the case for
+    //! combinational child modules in hierarchical mode.
+    static RTLIL::Wire *locateErrorClock(RTLIL::Module *module, const Options &options, bool optional) {
+        if (options.errorPipelineEvery == 0) {
+            return nullptr;
+        }
+
+        auto *clock = module->wire(options.errorClock);
+        if (clock == nullptr && optional) {
+            log_warning("Error tree clock '%s' not found in child module %s, so its error tree won't be "
+                        "registered\n",
+                log_id(options.errorClock), log_id(module->name));
+            return nullptr;
+        }
+        if (clock == nullptr) {
+            log_error("Error tree clock '%s' not found in module %s\n", log_id(options.errorClock),
+                log_id(module->name));
+        }
+        if (clock->width != 1) {
+            log_error("Error tree clock '%s' should be 1 bit, but it is %d bits\n", log_id(clock->name),
+                clock->width);
+        }
+        return clock;
+    }
+
+    //! Returns every selected module that has a definition (i.e. isn't a blackbox), ordered so that each
+    //! module comes after all of the modules it instantiates
+    static std::vector<RTLIL::Module *> getModulesBottomUp(RTLIL::Design *design) {
+        std::vector<RTLIL::Module *> out {};
+        ankerl::unordered_dense::set<RTLIL::Module *> visited;
+        ankerl::unordered_dense::set<RTLIL::Module *> selected;
+        for (auto *module : design->selected_modules()) {
+            selected.insert(module);
+        }
+
+        // post-order DFS over the hierarchy. hierarchies are shallow, so recursion is fine here
+        std::function<void(RTLIL::Module *)> visit = [&](RTLIL::Module *module) {
+            if (!visited.insert(module).second) {
+                return;
+            }
+            for (auto *cell : module->cells()) {
+                auto *child = design->module(cell->type);
+                if (child != nullptr && !child->get_blackbox_attribute()) {
+                    visit(child);
+                }
+            }
+            if (selected.contains(module)) {
+                out.push_back(module);
+            }
+        };
+
+        for (auto *module : design->selected_modules()) {
+            if (!module->get_blackbox_attribute()) {
+                visit(module);
+            }
+        }
+        return out;
+    }
+
+    //! Connects the error port of every instance of a hardened module in this module to a new wire, and marks
+    //! the instance as ignored, since it's already triplicated internally. Returns the new wires, with the
+    //! latency of the error signal on each.
+    std::vector<std::pair<RTLIL::Wire *, size_t>> connectHardenedInstances(RTLIL::Module *module) {
+        std::vector<std::pair<RTLIL::Wire *, size_t>> out {};
+        for (auto *cell : module->cells()) {
+            if (!hardened.contains(cell->type)) {
+                continue;
+            }
+            const auto &child = hardened.at(cell->type);
+
+            auto *err = module->addWire(tamaraId("instance_err"));
+            err->set_bool_attribute(VOTER_ANNOTATION);
+            cell->setPort(child.errorPort, err);
+            cell->set_bool_attribute(IGNORE_ANNOTATION);
+            log("Instance '%s' of hardened module %s reports errors on '%s'\n", log_id(cell->name),
+                log_id(cell->type), log_id(err->name));
+
+            out.emplace_back(err, child.errorLatency);
+        }
+        return out;
+    }
+
+    //! Moves every input of a hardened instance that isn't driven straight from the module's inputs onto a
+    //! new wire, marked (* tamara_instance_input *), and returns the new wires. These are the boundary
+    //! between this module and the instance, so the logic cone search treats them like output ports.
+    std::vector<RTLIL::Wire *> splitHardenedInstanceInputs(RTLIL::Module *module) {
+        std::vector<RTLIL::Wire *> out {};
+        for (auto *cell : module->cells()) {
+            if (!hardened.contains(cell->type)) {
+                continue;
+            }
+            auto *child = module->design->module(cell->type);
+
+            // setting the ports below would invalidate the iterator
+            std::vector<std::pair<RTLIL::IdString, RTLIL::SigSpec>> inputs;
+            for (const auto &[name, signal] : cell->connections()) {
+                const auto *port = child->wire(name);
+                if (port == nullptr || !port->port_input || signal.is_fully_const()) {
+                    continue;
+                }
+                auto wires = sigSpecWires(signal);
+                if (std::all_of(wires.begin(), wires.end(), [](auto *wire) { return wire->port_input; })) {
+                    continue;
+                }
+                inputs.emplace_back(name, signal);
+            }
+
+            for (const auto &[name, signal] : inputs) {
+                auto *wire = module->addWire(tamaraId("instance_in"), GetSize(signal));
+                wire->set_bool_attribute(INSTANCE_INPUT_ANNOTATION);
+                module->connect(wire, signal);
+                cell->setPort(name, wire);
+                log("Input %s of instance '%s' is driven by logic in this module, voting it on '%s'\n",
+                    log_id(name), log_id(cell->name), log_id(wire->name));
+                out.push_back(wire);
+            }
+        }
+        return out;
+    }
 
     //! Returns output wires for a module
     static std::vector<RTLIL::Wire *> getOutputPorts(RTLIL::Module *module) {
@@ -224,15 +874,16 @@ private:
         return out;
     }
 
-    //! Locates the error sink in the top module, i.e. the place where we route the voter error signal to. If
-    //! there is no error sink, this will raise a warning. We look for output wires from the module with the
-    //! annotation (* tamara_error_sink *).
-    void locateErrorSink(RTLIL::Module *module) {
+    //! Locates the error sink in the module, i.e. the place where we route the voter error signal to. We look
+    //! for output wires from the module with the annotation (* tamara_error_sink *). If there is no error
+    //! sink, this will raise a warning, unless makePort is set. In that case, the error sink must be an
+    //! output port (so that it can be routed to the parent module), and one is added if it's missing.
+    void locateErrorSink(RTLIL::Module *module, bool makePort) {
         errorSink = std::nullopt;
         for (const auto &wire : module->wires()) {
             if (wire->has_attribute(ERROR_SINK_ANNOTATION)) {
                 if (errorSink.has_value()) {
-                    log_error("Duplicate error sink: '%s'. Only one error sink is allowed per top module.\n",
+                    log_error("Duplicate error sink: '%s'. Only one error sink is allowed per module.\n",
                         log_id(wire));
                 }
 
@@ -241,9 +892,28 @@ private:
             }
         }
 
+        if (makePort && (!errorSink.has_value() || !errorSink.value()->port_output)) {
+            if (module->wire(ERROR_PORT_NAME) != nullptr) {
+                log_error("Module %s already has a wire called '%s', so TaMaRa can't add its error port\n",
+                    log_id(module->name), log_id(ERROR_PORT_NAME));
+            }
+            auto *port = module->addWire(ERROR_PORT_NAME);
+            port->port_output = true;
+            port->set_bool_attribute(ERROR_SINK_ANNOTATION);
+            module->fixup_ports();
+
+            if (errorSink.has_value()) {
+                // keep the existing sink, but drive it from the voters through the new port
+                module->connect(errorSink.value(), port);
+            }
+            log("Added error port '%s' to module %s\n", log_id(port->name), log_id(module->name));
+            errorSink = port;
+        }
+
         if (!errorSink.has_value()) {
-            log_warning("No error sink found for top module. The 'err' signal from TaMaRa voters will not be "
-                        "routed anywhere!\nYou should add (* tamara_error_sink *) to a wire.\n");
+            log_warning("No error sink found for module %s. The 'err' signal from TaMaRa voters will not be "
+                        "routed anywhere!\nYou should add (* tamara_error_sink *) to a wire.\n",
+                log_id(module->name));
         }
     }
 } const TamaraTMRPass;
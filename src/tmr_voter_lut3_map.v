@@ -0,0 +1,30 @@
+// TaMaRa: An automated triple modular redundancy EDA flow for Yosys.
+//
+// Copyright (c) 2025 Matt Young.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
+// was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+//
+// Lowers the $__tmr_voter cells inserted by `tamara_tmr -voter_cell` to one 3-input $lut per bit for the
+// majority, and one for the error signal. These are then mapped to the LUTs of the target FPGA as usual.
+// Usage, after TaMaRa: techmap -map src/tmr_voter_lut3_map.v
+(* techmap_celltype = "$__tmr_voter" *)
+module _tamara_tmr_voter_lut3 (A, B, C, Y, ERR);
+    parameter WIDTH = 1;
+
+    input [WIDTH-1:0] A;
+    input [WIDTH-1:0] B;
+    input [WIDTH-1:0] C;
+    output [WIDTH-1:0] Y;
+    output [WIDTH-1:0] ERR;
+
+    genvar i;
+    generate
+        for (i = 0; i < WIDTH; i = i + 1) begin : bit
+            // majority: set when at least two of the inputs are set
+            \$lut #(.WIDTH(3), .LUT(8'hE8)) vote (.A({C[i], B[i], A[i]}), .Y(Y[i]));
+            // error: set unless all of the inputs are the same
+            \$lut #(.WIDTH(3), .LUT(8'h7E)) err (.A({C[i], B[i], A[i]}), .Y(ERR[i]));
+        end
+    endgenerate
+endmodule
@@ -0,0 +1,23 @@
+// TaMaRa: An automated triple modular redundancy EDA flow for Yosys.
+//
+// Copyright (c) 2025 Matt Young.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
+// was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+//
+// Lowers the $__tmr_voter cells inserted by `tamara_tmr -voter_cell` to generic logic gates.
+// Usage, after TaMaRa: techmap -map src/tmr_voter_map.v
+(* techmap_celltype = "$__tmr_voter" *)
+module _tamara_tmr_voter (A, B, C, Y, ERR);
+    parameter WIDTH = 1;
+
+    input [WIDTH-1:0] A;
+    input [WIDTH-1:0] B;
+    input [WIDTH-1:0] C;
+    output [WIDTH-1:0] Y;
+    output [WIDTH-1:0] ERR;
+
+    assign Y = (A & B) | (A & C) | (B & C);
+    // set for every bit where the replicas don't all agree
+    assign ERR = (A ^ B) | (B ^ C);
+endmodule
@@ -5,17 +5,23 @@
 // This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
 // was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #include "tamara/util.hpp"
-#include "kernel/celltypes.h"
 #include "kernel/log.h"
 #include "kernel/rtlil.h"
 #include "kernel/yosys_common.h"
+#include "tamara/object_tags.hpp"
 #include "tamara/termcolour.hpp"
+#include <algorithm>
+#include <array>
 #include <chrono>
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
 #include <filesystem>
+#include <fstream>
 #include <random>
 #include <sstream>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 USING_YOSYS_NAMESPACE;
@@ -29,6 +35,39 @@ bool shouldConsiderForTMR(const RTLIL::AttrObject *obj) {
     return !obj->has_attribute(IGNORE_ANNOTATION);
 }
 
+//! Modules with fewer cells than this per thread are not worth splitting up
+constexpr size_t MIN_CELLS_PER_SHARD = 1024;
+
+//! Returns the number of shards to split count items into, given the requested number of threads
+size_t shardCount(size_t count, size_t threads) {
+    return std::max<size_t>(1, std::min(threads, count / MIN_CELLS_PER_SHARD));
+}
+
+//! Runs worker(shard, begin, end) for each of the contiguous shards of [0, count), each on its own thread.
+//! Shard 0 runs on the calling thread. Workers only read the netlist: they must not log, use a SigMap, or
+//! modify the design, and must only touch the cells in their own range.
+template <class F>
+void runSharded(size_t count, size_t shards, F &&worker) {
+    std::vector<std::thread> pool {};
+    pool.reserve(shards - 1);
+    for (size_t shard = 1; shard < shards; shard++) {
+        pool.emplace_back([&worker, count, shards, shard] {
+            worker(shard, count * shard / shards, count * (shard + 1) / shards);
+        });
+    }
+    worker(0, 0, count / shards);
+    for (auto &thread : pool) {
+        thread.join();
+    }
+}
+
+//! One port bit found by a worker while building a @ref tamara::ConnectionIndex, before it's normalised
+struct BitShardEntry {
+    RTLIL::SigBit bit;
+    PortBit port;
+    bool driver;
+};
+
 }; // namespace
 
 bool tamara::isDFF(const RTLIL::Cell *cell) {
@@ -37,159 +76,219 @@ bool tamara::isDFF(const RTLIL::Cell *cell) {
         ID($dlatch), ID($adlatch));
 }
 
-RTLIL::Wire *tamara::sigSpecToWire(const RTLIL::SigSpec &sigSpec) {
-    if (sigSpec.is_wire()) {
-        return sigSpec.as_wire();
-    }
-    if (sigSpec.is_bit()) {
-        return sigSpec.as_bit().wire;
-    }
-    if (!sigSpec.chunks().empty()) {
-        // FIXME this is somewhat questionable and should be tested on more designs
-        return sigSpec.chunks().front().wire;
+std::vector<RTLIL::Wire *> tamara::sigSpecWires(const RTLIL::SigSpec &sigSpec) {
+    std::vector<RTLIL::Wire *> out {};
+    for (const auto &chunk : sigSpec.chunks()) {
+        // there are usually very few chunks, so a linear search is fine
+        if (chunk.wire != nullptr && std::find(out.begin(), out.end(), chunk.wire) == out.end()) {
+            out.push_back(chunk.wire);
+        }
     }
-
-    // unhandled!
-    return nullptr;
+    return out;
 }
 
-std::pair<RTLILWireConnections, RTLILAnySignalConnections> tamara::analyseConnections(
-    const RTLIL::Module *module) {
-    RTLILWireConnections wireConnections {};
-    RTLILAnySignalConnections signalConnections {};
+ConnectionIndex::ConnectionIndex(RTLIL::Module *module, const CellPortOracle &ports, size_t threads)
+    : ports(ports)
+    , sigmap(module) {
+    // the workers only classify the ports of their cells, as the SigMap can't be shared between threads.
+    // the shards are then normalised and merged in cell order, so the result is the same no matter how many
+    // threads are used
+    auto cells = module->selected_cells();
+    std::vector<std::vector<BitShardEntry>> shards(shardCount(cells.size(), threads));
+
+    runSharded(cells.size(), shards.size(), [&](size_t index, size_t begin, size_t end) {
+        auto &shard = shards.at(index);
+        for (size_t i = begin; i < end; i++) {
+            auto *cell = cells.at(i);
+            // cells that are ignored by TaMaRa are never drivers or loads
+            if (!shouldConsiderForTMR(cell)) {
+                continue;
+            }
+            for (const auto &[name, signal] : cell->connections()) {
+                bool output = ports.isOutput(cell->type, name);
+                bool input = ports.isInput(cell->type, name);
+                for (int offset = 0; offset < GetSize(signal); offset++) {
+                    if (signal[offset].wire == nullptr) {
+                        continue;
+                    }
+                    PortBit portBit { .owner = cell, .port = name, .offset = offset };
+                    if (output) {
+                        shard.push_back({ .bit = signal[offset], .port = portBit, .driver = true });
+                    }
+                    if (input) {
+                        shard.push_back({ .bit = signal[offset], .port = portBit, .driver = false });
+                    }
+                }
+            }
+        }
+    });
 
-    // usage of CellTypes is based off Yosys' show command
-    CellTypes cellTypes(module->design);
+    for (const auto &shard : shards) {
+        for (const auto &entry : shard) {
+            update(entry.bit, entry.port, entry.driver, true);
+        }
+    }
 
-    for (const auto &cell : module->selected_cells()) {
-        // cells that are ignored by TaMaRa should never be neighbours
-        if (!shouldConsiderForTMR(cell)) {
-            log_debug("Skipping cell %s, not marked tamara_triplicate\n", log_id(cell->name));
+    // module inputs drive their bits, and module outputs read them
+    for (const auto &name : module->ports) {
+        auto *wire = module->wire(name);
+        if (!shouldConsiderForTMR(wire)) {
             continue;
         }
-
-        log_debug("Checking connections for cell: %s (%zu connections)\n", log_id(cell->name),
-            cell->connections().size());
-
-        // find wires that this is connected to
-        for (const auto &connection : cell->connections()) {
-            const auto &[name, signal] = connection;
-
-            Wire *wire = sigSpecToWire(signal);
-            if (wire == nullptr) {
-                // usually this occurs if the signal is const, so only log the warning if something unexpected
-                // happened
-                if (!signal.is_fully_const()) {
-                    log_warning("Trouble accessing wire from connection that we expected to be able to "
-                                "access: '%s'. Signal: '%s'\n",
-                        log_id(name), log_signal(signal));
-                }
-                continue;
-            }
-
-            // this is an output from the cell, so connect wire -> cell (remember we work backwards)
-            if (cellTypes.cell_output(cell->type, name)) {
-                wireConnections[wire].insert(cell);
-                signalConnections[wire].insert(signal);
-                log_debug("[neighbour wire] wire %s --> cell %s\n", log_id(wire->name), log_id(cell->name));
-                log_debug(
-                    "[neighbour signal] wire %s --> signal %s\n", log_id(wire->name), log_signal(signal));
+        for (int offset = 0; offset < wire->width; offset++) {
+            PortBit portBit { .owner = wire, .port = name, .offset = offset };
+            if (wire->port_input) {
+                update(RTLIL::SigBit(wire, offset), portBit, true, true);
             }
-
-            // this is an input to the cell, so connect cell -> wire (remember we work backwards)
-            if (cellTypes.cell_input(cell->type, name)) {
-                wireConnections[cell].insert(wire);
-                signalConnections[cell].insert(signal);
-                log_debug("[neighbour wire] cell %s --> wire %s\n", log_id(cell->name), log_id(wire->name));
-                log_debug(
-                    "[neighbour signal] cell %s --> signal %s\n", log_id(cell->name), log_signal(signal));
+            if (wire->port_output) {
+                update(RTLIL::SigBit(wire, offset), portBit, false, true);
             }
         }
-        log_debug("\n");
     }
 
-    // also add global connections
-    log("Checking global module connections\n");
-    for (const auto &connection : module->connections()) {
-        const auto &[lhs, rhs] = connection;
+    // nothing has changed yet, as far as the fix walkers are concerned
+    changed.clear();
+    changedSet.clear();
+    log("Indexed %zu bits from %zu cells in %zu shard(s)\n", bits.size(), cells.size(), shards.size());
+}
 
-        auto *lhsWire = sigSpecToWire(lhs);
-        auto *rhsWire = sigSpecToWire(rhs);
+const ConnectionIndex::BitConnections *ConnectionIndex::find(const RTLIL::SigBit &bit) const {
+    auto it = bits.find(sigmap(bit));
+    return it == bits.end() ? nullptr : &it->second;
+}
 
-        // provided lhsWire is defined, we can still insert the rhs (even if rhsWire is nullptr)
-        if (lhsWire != nullptr) {
-            signalConnections[lhsWire].insert(rhs);
-            log_debug("[neighbour signal] %s -> %s\n", log_id(lhsWire->name), log_signal(rhs));
-        }
+void ConnectionIndex::addCell(RTLIL::Cell *cell) {
+    for (const auto &[name, signal] : cell->connections()) {
+        updateCellPort(cell, name, signal, true);
+    }
+}
 
-        if (lhsWire != nullptr && rhsWire != nullptr) {
-            if (shouldConsiderForTMR(lhsWire) && shouldConsiderForTMR(rhsWire)) {
-                log_debug("[neighbour wire] %s --> %s\n", log_id(lhsWire->name), log_id(rhsWire->name));
+void ConnectionIndex::updatePort(
+    RTLIL::Cell *cell, const RTLIL::IdString &port, const RTLIL::SigSpec &previous) {
+    auto current = cell->hasPort(port) ? cell->getPort(port) : RTLIL::SigSpec();
+    if (previous.size() != current.size()) {
+        updateCellPort(cell, port, previous, false);
+        updateCellPort(cell, port, current, true);
+        return;
+    }
 
-                // apparently we don't actually need to reverse this, we're ok to just map lhs -> rhs
-                // despite doing backwards BFS
-                wireConnections[lhsWire].insert(rhsWire);
-            }
-        } else {
-            log_debug("Either RHS(%s) or LHS(%s) SigSpec is not a wire, skipping\n", log_signal(rhs),
-                log_signal(lhs));
+    // most rewrites only change a few bits of the port, so only those are touched
+    if (!shouldConsiderForTMR(cell)) {
+        return;
+    }
+    bool output = ports.isOutput(cell->type, port);
+    bool input = ports.isInput(cell->type, port);
+    auto updateBit = [&](const RTLIL::SigBit &bit, const PortBit &portBit, bool add) {
+        if (output) {
+            update(bit, portBit, true, add);
         }
+        if (input) {
+            update(bit, portBit, false, add);
+        }
+    };
+    for (int offset = 0; offset < current.size(); offset++) {
+        if (previous[offset] == current[offset]) {
+            continue;
+        }
+        PortBit portBit { .owner = cell, .port = port, .offset = offset };
+        updateBit(previous[offset], portBit, false);
+        updateBit(current[offset], portBit, true);
     }
-
-    log_debug("\nDone, located %zu neighbours from %zu cells\n", wireConnections.size(),
-        module->selected_cells().size());
-
-    return std::make_pair(wireConnections, signalConnections);
 }
 
-RTLILAnySignalConnections tamara::analyseCellOutputs(RTLIL::Module *module) {
-    RTLILAnySignalConnections out;
-
-    CellTypes cellTypes(module->design);
+void ConnectionIndex::updateConnection(const RTLIL::SigSpec &lhs, const RTLIL::SigSpec &rhs) {
+    if (lhs.size() != rhs.size()) {
+        log_error("TaMaRa internal error: Connection between '%s' and '%s' has mismatched widths\n",
+            log_signal(lhs), log_signal(rhs));
+    }
 
-    for (const auto &cell : module->cells()) {
-        for (const auto &connection : cell->connections()) {
-            const auto &[name, signal] = connection;
+    for (int i = 0; i < lhs.size(); i++) {
+        std::array<RTLIL::SigBit, 2> from { sigmap(lhs[i]), sigmap(rhs[i]) };
+        if (from[0] == from[1]) {
+            continue;
+        }
+        sigmap.add(lhs[i], rhs[i]);
+        auto merged = sigmap(lhs[i]);
 
-            // is this an output wire?
-            if (cellTypes.cell_output(cell->type, name)) {
-                out[cell].insert(signal);
+        // the two bits now share one entry. bits that are connected to a constant aren't indexed at all.
+        for (const auto &bit : from) {
+            auto it = bits.find(bit);
+            if (bit == merged || it == bits.end()) {
+                continue;
+            }
+            auto entry = std::move(it->second);
+            bits.erase(it);
+            if (merged.wire == nullptr) {
+                continue;
             }
+            auto &target = bits[merged];
+            target.drivers.insert(target.drivers.end(), entry.drivers.begin(), entry.drivers.end());
+            target.loads.insert(target.loads.end(), entry.loads.begin(), entry.loads.end());
+            markChanged(merged);
         }
     }
+}
 
+std::vector<RTLIL::SigBit> ConnectionIndex::takeChanged() {
+    // connections since a bit was changed may have merged it into another bit
+    std::vector<RTLIL::SigBit> out;
+    ankerl::unordered_dense::set<RTLIL::SigBit> seen;
+    out.reserve(changed.size());
+    for (const auto &bit : changed) {
+        auto normalised = sigmap(bit);
+        if (seen.insert(normalised).second) {
+            out.push_back(normalised);
+        }
+    }
+    changed.clear();
+    changedSet.clear();
     return out;
 }
 
-std::vector<RTLILAnyPtr> tamara::rtlilInverseLookup(const RTLILWireConnections &connections, Wire *target) {
-    // PERF: This is REALLY expensive currently on the order of O(n^2).
-    std::vector<RTLILAnyPtr> out;
-    for (const auto &pair : connections) {
-        const auto &[key, value] = pair;
+void ConnectionIndex::update(const RTLIL::SigBit &bit, const PortBit &portBit, bool driver, bool add) {
+    auto normalised = sigmap(bit);
+    if (normalised.wire == nullptr) {
+        return;
+    }
 
-        for (const auto &item : value) {
-            if (getRTLILName(item) == target->name) {
-                out.push_back(key);
-            }
+    if (add) {
+        auto &entry = bits[normalised];
+        (driver ? entry.drivers : entry.loads).push_back(portBit);
+    } else {
+        auto it = bits.find(normalised);
+        if (it == bits.end()) {
+            return;
+        }
+        std::erase(driver ? it->second.drivers : it->second.loads, portBit);
+        if (it->second.drivers.empty() && it->second.loads.empty()) {
+            bits.erase(it);
         }
     }
-    return out;
+    markChanged(normalised);
 }
 
-std::vector<RTLILAnyPtr> tamara::signalInverseLookup(
-    const RTLILAnySignalConnections &connections, const RTLIL::SigSpec &target) {
-    // PERF: This is REALLY expensive currently on the order of O(n^2).
-    std::vector<RTLILAnyPtr> out;
-    for (const auto &pair : connections) {
-        const auto &[key, value] = pair;
-
-        for (const auto &item : value) {
-            if (item == target) {
-                out.push_back(key);
-            }
+void ConnectionIndex::updateCellPort(
+    RTLIL::Cell *cell, const RTLIL::IdString &port, const RTLIL::SigSpec &signal, bool add) {
+    if (!shouldConsiderForTMR(cell)) {
+        return;
+    }
+    bool output = ports.isOutput(cell->type, port);
+    bool input = ports.isInput(cell->type, port);
+    for (int offset = 0; offset < signal.size(); offset++) {
+        PortBit portBit { .owner = cell, .port = port, .offset = offset };
+        if (output) {
+            update(signal[offset], portBit, true, add);
+        }
+        if (input) {
+            update(signal[offset], portBit, false, add);
         }
     }
-    return out;
+}
+
+void ConnectionIndex::markChanged(const RTLIL::SigBit &bit) {
+    if (changedSet.insert(bit).second) {
+        changed.push_back(bit);
+    }
 }
 
 RTLIL::IdString tamara::getRTLILName(const RTLILAnyPtr &ptr) {
@@ -206,12 +305,41 @@ RTLIL::IdString tamara::getRTLILName(const RTLILAnyPtr &ptr) {
         ptr);
 }
 
-RTLILConnections tamara::analyseAll(RTLIL::Module *module) {
+RTLILConnections tamara::analyseConnections(RTLIL::Module *module, const ConnectionIndex &index) {
+    NetlistGraph::Builder graphBuilder {};
+
+    // every load of a bit points to every driver of it. the index only has the cells that aren't ignored, so
+    // they're never neighbours. cells are connected straight to each other, however many wires, or slices
+    // of wires, the bits pass through on the way.
+    for (const auto &[bit, connections] : index.getBits()) {
+        for (const auto &load : connections.loads) {
+            for (const auto &driver : connections.drivers) {
+                graphBuilder.addEdge(load.owner, driver.owner);
+            }
+        }
+    }
+
+    // the inputs of hardened instances aren't read by anything in the index, as the instances are ignored
+    for (auto *wire : module->wires()) {
+        if (!wire->has_attribute(INSTANCE_INPUT_ANNOTATION)) {
+            continue;
+        }
+        for (int offset = 0; offset < wire->width; offset++) {
+            const auto *connections = index.find(RTLIL::SigBit(wire, offset));
+            if (connections == nullptr) {
+                continue;
+            }
+            for (const auto &driver : connections->drivers) {
+                graphBuilder.addEdge(wire, driver.owner);
+            }
+        }
+    }
+
     RTLILConnections out;
-    auto [wires, signals] = analyseConnections(module);
-    out.wires = wires;
-    out.signals = signals;
-    out.cellOutputs = analyseCellOutputs(module);
+    out.graph = graphBuilder.build();
+    out.sigmap = index.getSigMap();
+    log("Located %zu neighbours (%zu nodes) from %zu bits\n", out.graph.edgeCount(), out.graph.size(),
+        index.getBits().size());
     return out;
 }
 
@@ -258,15 +386,108 @@ std::string tamara::generateRandomHex(size_t len) {
     return ss.str();
 }
 
+namespace {
+
+//! One replica named with compact names
+struct NameMapEntry {
+    RTLIL::IdString replica;
+    RTLIL::IdString original;
+    int index;
+    uint32_t cone;
+};
+
+bool g_compact_names = false;
+std::vector<NameMapEntry> g_name_map;
+
+//! Formats the number in base 36, which keeps generated names short
+std::string toBase36(int value) {
+    constexpr std::string_view DIGITS = "0123456789abcdefghijklmnopqrstuvwxyz";
+    std::string out;
+    do {
+        out.push_back(DIGITS.at(value % DIGITS.size()));
+        value /= static_cast<int>(DIGITS.size());
+    } while (value > 0);
+    std::reverse(out.begin(), out.end());
+    return out;
+}
+
+//! Escapes a string for use inside a JSON string literal
+std::string escapeJson(const std::string &str) {
+    std::string out;
+    out.reserve(str.size());
+    for (auto c : str) {
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            // control characters can't appear in a string literal, even though they can in an escaped ID
+            std::array<char, 7> escaped {};
+            std::snprintf(escaped.data(), escaped.size(), "\\u%04x", static_cast<unsigned char>(c));
+            out += escaped.data();
+            continue;
+        }
+        out.push_back(c);
+    }
+    return out;
+}
+
+} // namespace
+
 RTLIL::IdString tamara::tamaraId(const std::string &name) {
+    if (g_compact_names) {
+        return "$t$" + toBase36(Yosys::autoidx++);
+    }
     return "$tmr$" + name + "$" + std::to_string(Yosys::autoidx++);
 }
 
+void tamara::setCompactNames(bool compact) {
+    g_compact_names = compact;
+    g_name_map.clear();
+}
+
+RTLIL::IdString tamara::replicaId(const RTLIL::IdString &original, int replica, uint32_t cone) {
+    if (!g_compact_names) {
+        return original.str() + replicaMarker(replica) + "_cone" + std::to_string(cone);
+    }
+
+    RTLIL::IdString name = replicaMarker(replica) + toBase36(Yosys::autoidx++);
+    g_name_map.push_back({ .replica = name, .original = original, .index = replica, .cone = cone });
+    return name;
+}
+
+std::string tamara::replicaMarker(int replica) {
+    if (g_compact_names) {
+        return "$r" + std::to_string(replica) + "$";
+    }
+    return "$replica" + std::to_string(replica);
+}
+
+void tamara::writeNameMap(const std::string &path) {
+    std::ofstream out(path);
+    if (!out) {
+        log_error("Failed to open name map '%s' for writing\n", path.c_str());
+    }
+
+    out << "{\n  \"replicas\": [";
+    for (size_t i = 0; i < g_name_map.size(); i++) {
+        const auto &entry = g_name_map[i];
+        out << (i == 0 ? "\n" : ",\n") << "    {\"replica\": \"" << escapeJson(entry.replica.str())
+            << "\", \"original\": \"" << escapeJson(entry.original.str()) << "\", \"index\": " << entry.index
+            << ", \"cone\": " << entry.cone << "}";
+    }
+    out << "\n  ]\n}\n";
+    log("Wrote %zu replica names to '%s'\n", g_name_map.size(), path.c_str());
+}
+
 std::string tamara::generateColours() {
     if (getenv("TAMARA_DISABLE_CONE_COLOURS") != nullptr) {
         return " ";
     }
 
+    // the pass only writes the tags out at the end, so objects replicated so far don't have a cone yet
+    if (const auto *tags = ObjectTags::active(); tags != nullptr) {
+        tags->writeAttributes(true);
+    }
+
     // TODO cache this
     std::string showColours;
     for (size_t i = 0; i < CONE_COLOURS.size(); i++) {
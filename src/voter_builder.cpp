@@ -8,32 +8,39 @@
 #include "kernel/log.h"
 #include "kernel/rtlil.h"
 #include "kernel/yosys_common.h"
+#include "tamara/edit_journal.hpp"
 #include "tamara/util.hpp"
+#include <algorithm>
 #include <cstdlib>
 
 USING_YOSYS_NAMESPACE;
 
 // NOLINTBEGIN(bugprone-macro-parentheses) These macros do not need parentheses
-#define WIRE(A, B) auto A##_##B##_wire = makeAsVoter(module->addWire(tamaraId(#A "_" #B "_wire")));
-#define NOT(number, A, B) makeAsVoter(module->addLogicNot(tamaraId("not" #number), A, B))
-#define AND(number, A, B, Y) makeAsVoter(module->addLogicAnd(tamaraId("and" #number), A, B, Y))
-#define OR(number, A, B, Y) makeAsVoter(module->addLogicOr(tamaraId("or" #number), A, B, Y))
+#define WIRE(A, B) auto A##_##B##_wire = makeAsVoter(journal, journal.addWire(tamaraId(#A "_" #B "_wire")));
+#define NOT(number, A, B) recordVoter(journal, module->addLogicNot(tamaraId("not" #number), A, B))
+#define AND(number, A, B, Y) recordVoter(journal, module->addLogicAnd(tamaraId("and" #number), A, B, Y))
+#define OR(number, A, B, Y) recordVoter(journal, module->addLogicOr(tamaraId("or" #number), A, B, Y))
 // NOLINTEND(bugprone-macro-parentheses)
 
 using namespace tamara;
 
 namespace {
 
-//! Makes sure that the RTLIL object is marked as a voter. This is mainly for the benefit of fault injection
+//! Makes sure that the RTLIL object is tagged as a voter. This is mainly for the benefit of fault injection
 //! testing, so that it doesn't flip the bits of voters.
 template <class T>
-constexpr T makeAsVoter(T obj) {
+T makeAsVoter(EditJournal &journal, T obj) {
     // we don't explicitly add (* tamara_ignore *), in case we want to process the circuit multiple times
     // intentionally as a test
-    obj->set_bool_attribute(VOTER_ANNOTATION);
+    journal.getTags().tagVoter(obj);
     return obj;
 }
 
+//! Records a cell built by one of the RTLIL::Module helpers in the journal, and tags it as a voter
+RTLIL::Cell *recordVoter(EditJournal &journal, RTLIL::Cell *cell) {
+    return journal.recordCell(makeAsVoter(journal, cell));
+}
+
 #ifdef TAMARA_DEBUG
 //! Inserts the custom voter cell type into the module. Currently this is only used for debug.
 RTLIL::Cell *insertVoterCell(RTLIL::Module *module, const RTLIL::SigSpec &a, const RTLIL::SigSpec &b,
@@ -45,7 +52,6 @@ RTLIL::Cell *insertVoterCell(RTLIL::Module *module, const RTLIL::SigSpec &a, con
     cell->setPort(ID(OUT), out);
     cell->setPort(ID(ERR), err);
     cell->set_bool_attribute(VOTER_ANNOTATION);
-    cell->check();
 
     return cell;
 }
@@ -58,17 +64,17 @@ namespace {
 //! Inserts one voter. This also takes an error signal, which should be eventually routed through a $reduce_or
 //! cell.
 // NOLINTNEXTLINE(bugprone-easily-swappable-parameters) This is just required
-void build(RTLIL::Module *module, RTLIL::Wire *a, RTLIL::Wire *b, RTLIL::Wire *c, RTLIL::Wire *out,
+void build(EditJournal &journal, RTLIL::Wire *a, RTLIL::Wire *b, RTLIL::Wire *c, RTLIL::Wire *out,
     RTLIL::Wire *err) {
     // N.B. This is all based on the Logisim design (tests/manual_tests/simple_tmr.circ)
+    auto *module = journal.getModule();
     DUMPASYNC;
 
 #if defined(TAMARA_DEBUG)
     if (getenv("TAMARA_DEBUG_BYPASS_VOTER") != nullptr) {
         log_warning("TAMARA_DEBUG_BYPASS_VOTER environment variable is set, bypassing voter generation\n");
 
-        insertVoterCell(module, a, b, c, out, err);
-        module->check();
+        journal.recordCell(insertVoterCell(module, a, b, c, out, err));
 
         DUMPASYNC;
         return;
@@ -143,6 +149,59 @@ void build(RTLIL::Module *module, RTLIL::Wire *a, RTLIL::Wire *b, RTLIL::Wire *c
     DUMPASYNC;
 }
 
+//! Inserts one word-level voter, which votes on every bit of the inputs at once. This is the same majority
+//! function as the gate-level voter, but built from one multi-bit cell per gate: out = ab | ac | bc, and
+//! err = (a ^ b) | (b ^ c), so err has one bit per voted bit.
+// NOLINTNEXTLINE(bugprone-easily-swappable-parameters) This is just required
+void buildWord(EditJournal &journal, RTLIL::Wire *a, RTLIL::Wire *b, RTLIL::Wire *c, RTLIL::Wire *out,
+    RTLIL::Wire *err) {
+    auto *module = journal.getModule();
+    auto bits = a->width;
+
+    log("Generating %d bit word-level voter:\n  a: %s\n  b: %s\n  c: %s\n  out: %s\n  err: %s\n", bits,
+        log_id(a->name), log_id(b->name), log_id(c->name), log_id(out->name), log_id(err->name));
+
+    auto *ab = makeAsVoter(journal, journal.addWire(tamaraId("and_ab_wire"), bits));
+    auto *ac = makeAsVoter(journal, journal.addWire(tamaraId("and_ac_wire"), bits));
+    auto *bc = makeAsVoter(journal, journal.addWire(tamaraId("and_bc_wire"), bits));
+    recordVoter(journal, module->addAnd(tamaraId("and_ab"), a, b, ab));
+    recordVoter(journal, module->addAnd(tamaraId("and_ac"), a, c, ac));
+    recordVoter(journal, module->addAnd(tamaraId("and_bc"), b, c, bc));
+
+    auto *abac = makeAsVoter(journal, journal.addWire(tamaraId("or_abac_wire"), bits));
+    recordVoter(journal, module->addOr(tamaraId("or_abac"), ab, ac, abac));
+    recordVoter(journal, module->addOr(tamaraId("or_out"), abac, bc, out));
+    DUMPASYNC;
+
+    auto *xab = makeAsVoter(journal, journal.addWire(tamaraId("xor_ab_wire"), bits));
+    auto *xbc = makeAsVoter(journal, journal.addWire(tamaraId("xor_bc_wire"), bits));
+    recordVoter(journal, module->addXor(tamaraId("xor_ab"), a, b, xab));
+    recordVoter(journal, module->addXor(tamaraId("xor_bc"), b, c, xbc));
+    recordVoter(journal, module->addOr(tamaraId("or_err"), xab, xbc, err));
+    DUMPASYNC;
+}
+
+//! Inserts one $__tmr_voter cell, which votes on every bit of the inputs at once, and is lowered to logic
+//! by a techmap after TMR
+// NOLINTNEXTLINE(bugprone-easily-swappable-parameters) This is just required
+void buildCell(EditJournal &journal, RTLIL::Wire *a, RTLIL::Wire *b, RTLIL::Wire *c, RTLIL::Wire *out,
+    RTLIL::Wire *err) {
+    auto *module = journal.getModule();
+
+    log("Generating %d bit voter cell:\n  a: %s\n  b: %s\n  c: %s\n  out: %s\n  err: %s\n", a->width,
+        log_id(a->name), log_id(b->name), log_id(c->name), log_id(out->name), log_id(err->name));
+
+    auto *voter = makeAsVoter(journal, module->addCell(tamaraId("tmr_voter"), VOTER_CELL_TYPE));
+    voter->setParam(ID::WIDTH, a->width);
+    voter->setPort(ID::A, a);
+    voter->setPort(ID::B, b);
+    voter->setPort(ID::C, c);
+    voter->setPort(ID::Y, out);
+    voter->setPort(ID(ERR), err);
+    journal.recordCell(voter);
+    DUMPASYNC;
+}
+
 }; // namespace
 
 // NOLINTNEXTLINE(readability-function-cognitive-complexity) Sorry, this function is just complicated
@@ -161,49 +220,51 @@ void VoterBuilder::build(RTLIL::Wire *a, RTLIL::Wire *b, RTLIL::Wire *c, RTLIL::
     // the ERROR wire is as wide as the number of input bits, we'll $reduce_or this down later; and then later
     // route it to the global module error signal
     // make an intermediate signal
-    auto *err_intermediate = module->addWire(tamaraId("ERR_INTERMEDIATE"), bits);
+    auto *err_intermediate = journal->addWire(tamaraId("ERR_INTERMEDIATE"), bits);
 
     log("Inserting voter in module %s for:\n  a: %s\n  b: %s\n  c: %s\n  out: %s\n", log_id(module->name),
         log_id(a->name), log_id(b->name), log_id(c->name), log_id(out->name));
 
-    // generate one unique voter per bit
-    for (int bit = 0; bit < bits; bit++) {
-        log("Adding voter for bit %d\n", bit);
-
-        // build SigChunks (these select bits from the wires)
-        RTLIL::SigChunk chunk_a(a, bit, 1);
-        RTLIL::SigChunk chunk_b(b, bit, 1);
-        RTLIL::SigChunk chunk_c(c, bit, 1);
-        RTLIL::SigChunk chunk_out(out, bit, 1);
-        RTLIL::SigChunk chunk_err(err_intermediate, bit, 1);
-
-        // create wire bits
-        auto *w_a = makeAsVoter(module->addWire(tamaraId("A")));
-        auto *w_b = makeAsVoter(module->addWire(tamaraId("B")));
-        auto *w_c = makeAsVoter(module->addWire(tamaraId("C")));
-        auto *w_out = makeAsVoter(module->addWire(tamaraId("OUT")));
-        auto *w_err = makeAsVoter(module->addWire(tamaraId("ERR")));
-        DUMPASYNC;
+    if (style == VoterStyle::Word) {
+        // one voter for the whole signal
+        ::buildWord(*journal, a, b, c, out, err_intermediate);
+        size += bits;
+    } else if (style == VoterStyle::Cell) {
+        ::buildCell(*journal, a, b, c, out, err_intermediate);
+        size += bits;
+    } else {
+        // generate one unique voter per bit
+        for (int bit = 0; bit < bits; bit++) {
+            log("Adding voter for bit %d\n", bit);
+
+            // build SigChunks (these select bits from the wires)
+            RTLIL::SigChunk chunk_a(a, bit, 1);
+            RTLIL::SigChunk chunk_b(b, bit, 1);
+            RTLIL::SigChunk chunk_c(c, bit, 1);
+            RTLIL::SigChunk chunk_out(out, bit, 1);
+            RTLIL::SigChunk chunk_err(err_intermediate, bit, 1);
+
+            // create wire bits
+            auto *w_a = makeAsVoter(*journal, journal->addWire(tamaraId("A")));
+            auto *w_b = makeAsVoter(*journal, journal->addWire(tamaraId("B")));
+            auto *w_c = makeAsVoter(*journal, journal->addWire(tamaraId("C")));
+            auto *w_out = makeAsVoter(*journal, journal->addWire(tamaraId("OUT")));
+            auto *w_err = makeAsVoter(*journal, journal->addWire(tamaraId("ERR")));
+            DUMPASYNC;
 
-        // attach SigChunks to voter wires
-        module->connect(w_a, chunk_a);
-        DUMPASYNC;
-        module->connect(w_b, chunk_b);
-        DUMPASYNC;
-        module->connect(w_c, chunk_c);
-        DUMPASYNC;
-        module->connect(chunk_out, w_out);
-        DUMPASYNC;
-        module->connect(chunk_err, w_err);
-        DUMPASYNC;
-        module->check();
-        DUMPASYNC;
+            // attach SigChunks to voter wires
+            journal->connect(w_a, chunk_a);
+            journal->connect(w_b, chunk_b);
+            journal->connect(w_c, chunk_c);
+            journal->connect(chunk_out, w_out);
+            journal->connect(chunk_err, w_err);
+            DUMPASYNC;
 
-        // construct voter
-        ::build(module, w_a, w_b, w_c, w_out, w_err);
-        module->check();
-        DUMPASYNC;
-        size++;
+            // construct voter
+            ::build(*journal, w_a, w_b, w_c, w_out, w_err);
+            DUMPASYNC;
+            size++;
+        }
     }
 
     // now what we do is reduce the error signal for this cone ONLY down to a single bit using the $reduce_or
@@ -212,12 +273,13 @@ void VoterBuilder::build(RTLIL::Wire *a, RTLIL::Wire *b, RTLIL::Wire *c, RTLIL::
     // OR'ing them all together, but that happens in finalise()
 
     // output from the intermediate (will be used in the OR)
-    auto *err_intermediate_out = makeAsVoter(module->addWire(tamaraId("ERR_INTER_OUT")));
+    auto *err_intermediate_out = makeAsVoter(*journal, journal->addWire(tamaraId("ERR_INTER_OUT")));
     DUMPASYNC;
 
     // insert $reduce_or reduction to OR every err bit in the voter (only for multi-bit voters)
     if (bits > 1) {
-        makeAsVoter(module->addReduceOr(tamaraId("REDUCE"), err_intermediate, err_intermediate_out));
+        recordVoter(
+            *journal, module->addReduceOr(tamaraId("REDUCE"), err_intermediate, err_intermediate_out));
     } else {
         // NOTE as per https://github.com/mattyoung101/tamara/issues/44
         // there is something wrong for some reason with using module->connect, it makes the circuit look
@@ -225,20 +287,32 @@ void VoterBuilder::build(RTLIL::Wire *a, RTLIL::Wire *b, RTLIL::Wire *c, RTLIL::
         // invalid.
         // SO, as a quick fix, we are going to insert a $buf cell here, which should not add as much critical
         // path delay as a $reduce_or; but ideally we should fix this
-        makeAsVoter(module->addBuf(tamaraId("REDUCE"), err_intermediate, err_intermediate_out));
+        recordVoter(*journal, module->addBuf(tamaraId("REDUCE"), err_intermediate, err_intermediate_out));
         // TODO fix the statement below
         //
         // module->connect(err_intermediate, err_intermediate_out);
     }
 
     // store as a reduction that we'll access later in finalise
-    reductions.push_back(err_intermediate_out);
+    reductions.push_back({ .wire = err_intermediate_out, .latency = 0 });
     DUMPASYNC;
+}
+
+void VoterBuilder::addErrorSource(RTLIL::Wire *err, size_t latency) {
+    NOTNULL(err);
+    log_assert(err->width == 1 && "Error source should be 1 bit");
+    reductions.push_back({ .wire = err, .latency = latency });
+}
 
-    module->check();
+RTLIL::Wire *VoterBuilder::addErrorStage(RTLIL::Wire *signal) {
+    // starts out clear, otherwise the error sink would report an error before the first clock edge
+    auto *q = makeAsVoter(*journal, journal->addWire(tamaraId("err_stage_q")));
+    q->attributes[ID::init] = RTLIL::Const(0, 1);
+    recordVoter(*journal, module->addDff(tamaraId("err_stage"), errorClock, signal, q));
+    return q;
 }
 
-void VoterBuilder::finalise(RTLIL::Wire *err) {
+size_t VoterBuilder::finalise(RTLIL::Wire *err) {
     if (err->width != 1) {
         log_error(
             "Voter error signal '%s' should be 1 bit. Yours is %d bits.", log_id(err->name), err->width);
@@ -247,39 +321,98 @@ void VoterBuilder::finalise(RTLIL::Wire *err) {
     log("Finalising %zu $reduce_or voter reduction(s) in module %s\n", reductions.size(),
         log_id(module->name));
 
-    // special case if there's only one reduction, we can just wire it directly to the output
-    if (reductions.size() == 1) {
-        log("Special case (direct wiring) since reductions.size() == 1\n");
-        module->connect(err, reductions[0]);
-        module->check();
-        DUMPASYNC;
-        return;
+    if (reductions.empty()) {
+        log_warning("No voters or error sources in module %s, error sink '%s' will not be driven\n",
+            log_id(module->name), log_id(err->name));
+        return 0;
     }
 
-    Wire *prev = nullptr;
-    // we start at idx=1, so that we link idx 1 and idx 0; idx 0 has no previous reduction so doesn't need an
-    // OR chain
-    for (size_t i = 1; i < reductions.size(); i++) {
-        if (prev == nullptr) {
-            // initially, start off by OR'ing together reductions[0] and reductions[1], and storing this
-            auto *orOut = makeAsVoter(module->addWire(tamaraId("initial_or_out")));
-            makeAsVoter(module->addLogicOr(tamaraId("initial_or"), reductions[0], reductions[1], orOut));
-            prev = orOut;
-            DUMPASYNC;
-        } else {
-            // otherwise, continue the OR chain by building an OR that takes prev and cur
-            auto *orOut
-                = makeAsVoter(module->addWire(tamaraId("or_tree_" + std::to_string(i) + "_out")));
-            makeAsVoter(module->addLogicOr(
-                tamaraId("or_tree_" + std::to_string(i)), prev, reductions[i], orOut));
-            prev = orOut;
-            DUMPASYNC;
+    // errors from hardened instances have already been through their own tree, so delay everything else to
+    // match the slowest source. otherwise, the cycle an error is reported in would depend on where it was.
+    size_t latency = 0;
+    for (const auto &source : reductions) {
+        latency = std::max(latency, source.latency);
+    }
+    std::vector<RTLIL::Wire *> level;
+    level.reserve(reductions.size());
+    for (const auto &source : reductions) {
+        auto *signal = source.wire;
+        if (errorClock != nullptr) {
+            for (auto i = source.latency; i < latency; i++) {
+                signal = addErrorStage(signal);
+            }
+        } else if (source.latency != latency) {
+            log_warning("Error source '%s' is %zu cycle(s) late, but there's no error clock in module %s to "
+                        "delay the other error sources to match it\n",
+                log_id(source.wire->name), source.latency, log_id(module->name));
+        }
+        level.push_back(signal);
+    }
+
+    // a fan-in of 0 means a single wide $reduce_or over every reduction, which is a tree of one level
+    auto fanIn = errorFanIn == 0 ? level.size() : errorFanIn;
+    log_assert((errorFanIn == 0 || fanIn >= 2) && "Error fan-in must be at least 2");
+    auto *cellName = errorFanIn == 0 ? "err_reduce" : "err_tree";
+
+    // build a balanced tree: each level ORs together groups of up to fanIn signals from the one before, so
+    // the error path has a depth of log_fanIn(reductions). a single reduction is a tree of depth 0.
+    size_t depth = 0;
+    size_t stages = 0;
+    while (level.size() > 1) {
+        std::vector<RTLIL::Wire *> next;
+        next.reserve((level.size() + fanIn - 1) / fanIn);
+
+        for (size_t i = 0; i < level.size(); i += fanIn) {
+            auto end = std::min(i + fanIn, level.size());
+            if (end - i == 1) {
+                // odd one out, just goes up to the next level
+                next.push_back(level[i]);
+                continue;
+            }
+
+            auto *orOut = makeAsVoter(*journal, journal->addWire(tamaraId("err_tree_out")));
+            if (end - i == 2) {
+                recordVoter(*journal, module->addLogicOr(tamaraId(cellName), level[i], level[i + 1], orOut));
+            } else {
+                RTLIL::SigSpec group;
+                for (size_t j = i; j < end; j++) {
+                    group.append(level[j]);
+                }
+                recordVoter(*journal, module->addReduceOr(tamaraId(cellName), group, orOut));
+            }
+            next.push_back(orOut);
         }
+
+        level = std::move(next);
+        depth++;
+
+        // register every signal that leaves this level, so no combinational path spans more than
+        // errorPipelineEvery levels. the odd ones out are registered too, so every path through the tree
+        // has the same number of stages.
+        if (errorClock != nullptr && depth % errorPipelineEvery == 0) {
+            for (auto &signal : level) {
+                signal = addErrorStage(signal);
+            }
+            stages++;
+        }
+        DUMPASYNC;
+    }
+    log("Built error tree of depth %zu with fan-in %zu\n", depth, fanIn);
+
+    // the root is always registered, so that the tree adds at least one cycle no matter how many voters there
+    // are, and an error never reaches the sink combinationally
+    if (errorClock != nullptr && (depth == 0 || depth % errorPipelineEvery != 0)) {
+        level[0] = addErrorStage(level[0]);
+        stages++;
+    }
+    latency += stages;
+    if (errorClock != nullptr || latency != 0) {
+        log("Error tree has %zu register stage(s), so errors reach '%s' %zu clock cycle(s) late\n", stages,
+            log_id(err->name), latency);
     }
 
-    // now link prev to the actual output
-    NOTNULL(prev);
-    module->connect(prev, err);
-    module->check();
+    // now link the root of the tree to the actual output
+    journal->connect(err, level[0]);
     DUMPASYNC;
+    return latency;
 }
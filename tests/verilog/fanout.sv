@@ -0,0 +1,15 @@
+// Logic shared between two logic cones: the AND gate is replicated by the cone of out1, but is also read by
+// the cone of out2
+module fanout(
+    input logic a,
+    input logic b,
+    input logic c,
+    input logic d,
+    output logic out1,
+    output logic out2
+);
+    logic shared;
+    assign shared = a & b;
+    assign out1 = shared | c;
+    assign out2 = shared ^ d;
+endmodule
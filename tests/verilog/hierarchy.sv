@@ -0,0 +1,45 @@
+// Two instances of the same pipelined inverter, used to test hierarchical TMR
+module hierarchy_stage(
+    input logic clk,
+    input logic a,
+    output logic out
+);
+    always_ff @(posedge clk) begin
+        out <= !a;
+    end
+endmodule
+
+// Combinational child module, which doesn't have a clock for a pipelined error tree
+module hierarchy_mix(
+    input logic a,
+    input logic b,
+    output logic out
+);
+    assign out = a ^ b;
+endmodule
+
+module hierarchy(
+    input logic clk,
+    input logic a,
+    output logic out,
+    (* tamara_error_sink *)
+    output logic err
+);
+    logic middle;
+    logic mixed;
+    logic glue;
+
+    hierarchy_stage stage1(.clk(clk), .a(a), .out(middle));
+    hierarchy_mix mix(.a(middle), .b(a), .out(mixed));
+
+    // glue logic in the parent that only feeds the second stage
+    always_ff @(posedge clk) begin
+        glue <= !mixed;
+    end
+
+    hierarchy_stage stage2(.clk(clk), .a(glue), .out(out));
+
+`ifndef TAMARA
+    assign err = 0;
+`endif
+endmodule
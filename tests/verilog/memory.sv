@@ -29,3 +29,29 @@ always @(posedge clk_i) begin
 end
 
 endmodule
+
+// Small memory with known initial contents, used to check that scrubbing repairs an upset word
+module memory_init (
+    input            clk_i,
+    input            we_i,
+    input      [1:0] addr_i,
+    input      [3:0] data_i,
+    output reg [3:0] data_o
+);
+
+reg [3:0] mem [0:3];
+
+initial begin
+    mem[0] = 4'h1;
+    mem[1] = 4'h2;
+    mem[2] = 4'h3;
+    mem[3] = 4'h4;
+end
+
+always @(posedge clk_i) begin
+    if (we_i)
+        mem[addr_i] <= data_i;
+    data_o <= mem[addr_i];
+end
+
+endmodule
@@ -0,0 +1,27 @@
+// Two outputs driven by the same gate
+module shared_output(
+    input logic a,
+    input logic b,
+    output logic out1,
+    output logic out2
+);
+    assign out1 = a & b;
+    assign out2 = out1;
+endmodule
+
+// Two different FFs driven by the same gate. Both FF cones reach the AND gate as their voter cut point, but
+// only the first one owns it.
+module shared_driver(
+    input logic clk,
+    input logic en,
+    input logic a,
+    input logic b,
+    output logic out1,
+    output logic out2
+);
+    logic shared;
+    assign shared = a & b;
+
+    always_ff @(posedge clk) out1 <= shared;
+    always_ff @(posedge clk) if (en) out2 <= shared;
+endmodule
@@ -0,0 +1,26 @@
+// A wide but shallow registered datapath, used to test analysing connections with several threads. After
+// splitcells, every bit has its own AND, XOR and FF, so the module has well over 1024 cells for each of 4
+// threads.
+
+(* tamara_triplicate *)
+module wide_datapath #(
+    parameter int WIDTH = 1536
+) (
+    input logic clk,
+    input logic[WIDTH-1:0] a,
+    input logic[WIDTH-1:0] b,
+    input logic[WIDTH-1:0] c,
+    output logic[WIDTH-1:0] o,
+    (* tamara_error_sink *)
+    output logic err
+);
+
+always_ff @(posedge clk) begin
+    o <= (a & b) ^ c;
+end
+
+`ifndef TAMARA
+assign err = 0;
+`endif
+
+endmodule
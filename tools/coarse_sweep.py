@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+# TaMaRa: An automated triple modular redundancy EDA flow for Yosys.
+#
+# Copyright (c) 2025 Matt Young.
+#
+# This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
+# was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+from typing import List, Tuple
+import subprocess
+import os
+import argparse
+import tempfile
+import time
+import re
+
+# This script compares the fine-grained (per logic cone) and coarse (-coarse, per module) TMR flows, in terms
+# of area (number of cells after a generic synth), latency (longest topological path) and runtime.
+# Must be run from build dir.
+# The general method for running this tool is, from the TaMaRa build directory:
+# ../tools/coarse_sweep.py --designs ../tests/verilog/shiftreg.sv:shiftreg ../tests/verilog/crc.v:crc16
+
+# the fine flow is run on split cells and nets, the same way as the regression scripts
+FLOWS = {"fine": "splitcells\nsplitnets\ntamara_tmr", "coarse": "tamara_tmr -coarse"}
+
+SCRIPT_TEMPLATE = """
+plugin -i libtamara.so
+read_verilog -sv {verilog}
+hierarchy -top {top}
+prep
+{tmr}
+opt_clean
+synth -flatten -top {top} -run begin:fine
+abc -g AND,NAND,OR,NOR,XOR,XNOR,MUX
+opt_clean
+stat
+ltp -noff
+"""
+
+CELLS_REGEX = re.compile(r"Number of cells:\s+(\d+)")
+LTP_REGEX = re.compile(r"Longest topological path in .+ \(length=(\d+)\)")
+
+
+# Runs one flow on one design, returning (cells, longest path, wall clock time in seconds)
+def run_flow(verilog_path: str, top: str, tmr: str) -> Tuple[int, int, float]:
+    # see tools/0001-Add-YS_IGNORE_SHOW-to-show.cc.patch
+    os.environ["YS_IGNORE_SHOW"] = "1"
+    os.environ["TAMARA_NO_DUMP"] = "1"
+
+    with tempfile.NamedTemporaryFile(mode="w", suffix=".ys", delete=True) as f:
+        f.write(SCRIPT_TEMPLATE.format(verilog=verilog_path, top=top, tmr=tmr))
+        f.flush()
+
+        begin = time.perf_counter()
+        result = subprocess.run(
+            ["yosys", "-s", f.name],
+            stdout=subprocess.PIPE,
+            stderr=subprocess.STDOUT,  # Redirect stderr into stdout
+        )
+        end = time.perf_counter()
+
+    output = result.stdout.decode("utf-8")
+    if result.returncode != 0:
+        print(output)
+        raise RuntimeError(f"Yosys failed on {top} with '{tmr}'")
+
+    # stat is run once, but print the last match anyway in case the script grows
+    cells = int(CELLS_REGEX.findall(output)[-1])
+    path = int(LTP_REGEX.findall(output)[-1])
+    return cells, path, end - begin
+
+
+def main(designs: List[str]):
+    print(f"{'design':<20} {'flow':<8} {'cells':>8} {'path':>6} {'time (s)':>10}")
+
+    for design in designs:
+        verilog_path, top = design.split(":")
+        for name, tmr in FLOWS.items():
+            cells, path, elapsed = run_flow(verilog_path, top, tmr)
+            print(f"{top:<20} {name:<8} {cells:>8} {path:>6} {elapsed:>10.2f}")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument(
+        "--designs",
+        help="Designs to compare, each given as verilog_path:top_module",
+        type=str,
+        nargs="+",
+        default=["../tests/verilog/shiftreg.sv:shiftreg", "../tests/verilog/crc.v:crc16"],
+    )
+    args = parser.parse_args()
+
+    main(args.designs)
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+# TaMaRa: An automated triple modular redundancy EDA flow for Yosys.
+#
+# Copyright (c) 2025 Matt Young.
+#
+# This Source Code Form is subject to the terms of the Mozilla Public License, v. 2.0. If a copy of the MPL
+# was not distributed with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+from typing import List
+import subprocess
+import os
+import argparse
+import tempfile
+import time
+import statistics
+
+# This script measures how long `tamara_tmr` takes at each `-verify` level.
+# Must be run from build dir.
+# The general method for running this tool is, from the TaMaRa build directory:
+# ../tools/verify_benchmark.py --verilog ../tests/verilog/picorv32.v --top picorv32 --samples 3
+
+LEVELS = ["none", "end", "cone", "paranoid"]
+
+SCRIPT_TEMPLATE = """
+plugin -i libtamara.so
+read_verilog {verilog}
+hierarchy -top {top}
+prep
+splitcells
+splitnets
+tamara_tmr -verify {level}
+"""
+
+
+# Runs one sample of TaMaRa at the given verify level, returning its wall clock time in seconds
+def sample(verilog_path: str, top: str, level: str) -> float:
+    # see tools/0001-Add-YS_IGNORE_SHOW-to-show.cc.patch
+    os.environ["YS_IGNORE_SHOW"] = "1"
+    os.environ["TAMARA_NO_DUMP"] = "1"
+
+    with tempfile.NamedTemporaryFile(mode="w", suffix=".ys", delete=True) as f:
+        f.write(SCRIPT_TEMPLATE.format(verilog=verilog_path, top=top, level=level))
+        f.flush()
+
+        begin = time.perf_counter()
+        result = subprocess.run(
+            ["yosys", "-q", "-s", f.name],
+            stdout=subprocess.PIPE,
+            stderr=subprocess.STDOUT,  # Redirect stderr into stdout
+        )
+        end = time.perf_counter()
+
+        if result.returncode != 0:
+            print(result.stdout.decode("utf-8"))
+            raise RuntimeError(f"Yosys failed at verify level '{level}'")
+
+    return end - begin
+
+
+def main(verilog_path: str, top: str, samples: int, levels: List[str]):
+    print(f"Benchmarking {top} ({verilog_path}) with {samples} sample(s) per level")
+    print(f"{'level':<10} {'mean (s)':>10} {'min (s)':>10} {'max (s)':>10}")
+
+    for level in levels:
+        times = [sample(verilog_path, top, level) for _ in range(samples)]
+        print(f"{level:<10} {statistics.mean(times):>10.2f} {min(times):>10.2f} {max(times):>10.2f}")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument(
+        "--verilog", help="Verilog file to test", type=str, default="../tests/verilog/picorv32.v"
+    )
+    parser.add_argument("--top", help="Top file in Verilog", type=str, default="picorv32")
+    parser.add_argument(
+        "--samples", help="Number of runs per verify level", type=int, default=3
+    )
+    parser.add_argument(
+        "--levels", help="Comma separated verify levels to run", type=str, default=",".join(LEVELS)
+    )
+    args = parser.parse_args()
+
+    main(args.verilog, args.top, args.samples, args.levels.split(","))